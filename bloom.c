@@ -0,0 +1,287 @@
+/********************************************************\
+ * bloom.c --  a Bloom filter that answers most lookups *
+ *             of absent keys from one cache line       *
+ *                                                      *
+ * Authors:    James Douglas, Paul Souter,              *
+ *             Ryan Swanepoel                           *
+ *                                                      *
+ * Purpose:    to reject words that are not in a        *
+ *             dictionary before it is searched         *
+ *                                                      *
+\********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "mylib.h"
+#include "bloom.h"
+
+/* each key sets all of its bits in one block of 512 bits, which is
+   one 64 byte cache line */
+#define BLOCK_BITS 512
+#define BLOCK_WORDS (BLOCK_BITS / 32)
+#define CACHE_LINE 64
+#define MAX_PROBES 16
+/* number of keys bloom_contains_batch hashes before testing any */
+#define BATCH 16
+/* number of keys bloom_search_batch puts through the filter at once */
+#define SEARCH_BATCH 64
+
+#define MIX_K1 UINT64_C(0xff51afd7ed558ccd)
+#define MIX_K2 UINT64_C(0xc4ceb9fe1a85ec53)
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) 0)
+#endif
+
+struct block{
+    uint32_t bits[BLOCK_WORDS];
+};
+
+struct bloomrec{
+    struct block *blocks;/*aligned to a cache line*/
+    void *mem;/*what was allocated for blocks*/
+    uint32_t num_blocks;
+    int probes;/*the number of bits each key sets*/
+    long negatives;/*keys bloom_search_batch found not to be there*/
+    long passed;/*of those, the keys the filter let through anyway*/
+};
+
+/**
+ * hashes a key to 64 bits with FNV-1a and a final mix, so the high
+ * half can choose the block and the low half the bits in it.
+ *
+ * @param key the key to hash.
+ *
+ * @return the hash of key.
+ */
+static uint64_t bloom_hash(const char *key){
+    uint64_t h = UINT64_C(14695981039346656037);
+    while(*key != '\0'){
+        h = (h ^ (unsigned char) *key++) * UINT64_C(1099511628211);
+    }
+    h ^= h >> 33;
+    h *= MIX_K1;
+    h ^= h >> 33;
+    h *= MIX_K2;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * finds the block a hash belongs to, by scaling the high half of the
+ * hash to the number of blocks rather than taking a remainder.
+ *
+ * @param b the filter.
+ * @param h the hash of a key.
+ *
+ * @return the block.
+ */
+static struct block *bloom_block(bloom b, uint64_t h){
+    return b->blocks + (uint32_t) (((h >> 32) * b->num_blocks) >> 32);
+}
+
+/**
+ * creates an empty filter big enough to hold the given number of keys
+ * with the given number of bits for each. Each key sets about
+ * 0.69 * bits_per_key bits, the number that gives the fewest false
+ * positives.
+ *
+ * @param keys the number of keys that will be added.
+ * @param bits_per_key the size of the filter for each key.
+ *
+ * @return result the new filter.
+ */
+bloom bloom_new(int keys, int bits_per_key){
+    bloom result = emalloc(sizeof *result);
+    uint64_t bits;
+    uint32_t i;
+    int j;
+
+    if(bits_per_key < 1){
+        bits_per_key = 1;
+    }
+    bits = (uint64_t) (keys > 0 ? keys : 1) * bits_per_key;
+    result->num_blocks = (uint32_t) ((bits + BLOCK_BITS - 1) / BLOCK_BITS);
+    result->probes = (bits_per_key * 69 + 50) / 100;
+    if(result->probes < 1){
+        result->probes = 1;
+    }else if(result->probes > MAX_PROBES){
+        result->probes = MAX_PROBES;
+    }
+    result->negatives = 0;
+    result->passed = 0;
+    result->mem = emalloc(result->num_blocks * sizeof (struct block)
+                          + CACHE_LINE - 1);
+    result->blocks = (struct block *) (((uintptr_t) result->mem
+                                        + CACHE_LINE - 1)
+                                       & ~(uintptr_t) (CACHE_LINE - 1));
+    for(i = 0; i < result->num_blocks; i++){
+        for(j = 0; j < BLOCK_WORDS; j++){
+            result->blocks[i].bits[j] = 0;
+        }
+    }
+    return result;
+}
+
+/**
+ * adds a key to the filter.
+ *
+ * @param b the filter.
+ * @param key the key to add.
+ */
+void bloom_add(bloom b, const char *key){
+    uint64_t h = bloom_hash(key);
+    struct block *blk = bloom_block(b, h);
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (h1 >> 16) | (h1 << 16);
+    uint32_t bit;
+    int i;
+    for(i = 0; i < b->probes; i++){
+        bit = (h1 + i * h2) % BLOCK_BITS;
+        blk->bits[bit / 32] |= (uint32_t) 1 << (bit % 32);
+    }
+}
+
+/**
+ * checks whether a key may have been added to the filter.
+ *
+ * @param b the filter.
+ * @param h the hash of the key.
+ *
+ * @return 0 if the key was certainly never added, 1 if it may have
+ * been.
+ */
+static int bloom_test(bloom b, uint64_t h){
+    struct block *blk = bloom_block(b, h);
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (h1 >> 16) | (h1 << 16);
+    uint32_t bit;
+    int i;
+    for(i = 0; i < b->probes; i++){
+        bit = (h1 + i * h2) % BLOCK_BITS;
+        if(!(blk->bits[bit / 32] & ((uint32_t) 1 << (bit % 32)))){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * checks whether a key may have been added to the filter.
+ *
+ * @param b the filter.
+ * @param key the key to look for.
+ *
+ * @return 0 if key was certainly never added, 1 if it may have been.
+ */
+int bloom_contains(bloom b, const char *key){
+    return bloom_test(b, bloom_hash(key));
+}
+
+/**
+ * checks whether several keys may have been added to the filter,
+ * BATCH at a time: the blocks of a group are all prefetched before
+ * any is tested.
+ *
+ * @param b the filter.
+ * @param keys the keys to look for.
+ * @param n the number of keys.
+ * @param results set to 0 for each key certainly never added, 1 for
+ * each that may have been.
+ */
+void bloom_contains_batch(bloom b, char **keys, int n, int *results){
+    uint64_t hashes[BATCH];
+    int i, j, m;
+    for(i = 0; i < n; i += m){
+        m = (n - i < BATCH) ? n - i : BATCH;
+        for(j = 0; j < m; j++){
+            hashes[j] = bloom_hash(keys[i + j]);
+            PREFETCH(bloom_block(b, hashes[j]));
+        }
+        for(j = 0; j < m; j++){
+            results[i + j] = bloom_test(b, hashes[j]);
+        }
+    }
+}
+
+/**
+ * looks several keys up in a dictionary, with the filter in front of
+ * it: only the keys the filter lets through are searched for. The
+ * filter keeps count of how many keys were not found and how many of
+ * them it let through, and may be used from several threads at once.
+ *
+ * @param b the filter, or NULL to search for every key.
+ * @param search sets found[i] to what the dictionary has for words[i]
+ * for each of n words, 0 if nothing.
+ * @param dict passed on to search.
+ * @param keys the keys to look up.
+ * @param n the number of keys.
+ * @param found set to what search found for each key, 0 for each the
+ * filter rejected.
+ */
+void bloom_search_batch(bloom b,
+                        void search(void *dict, char **words, int n,
+                                    int *found),
+                        void *dict, char **keys, int n, int *found){
+    char *maybe[SEARCH_BATCH];
+    int where[SEARCH_BATCH];
+    int passed[SEARCH_BATCH];
+    long negatives = 0, false_positives = 0;
+    int i, j, k, m;
+
+    if(b == NULL){
+        search(dict, keys, n, found);
+        return;
+    }
+    for(i = 0; i < n; i += m){
+        m = (n - i < SEARCH_BATCH) ? n - i : SEARCH_BATCH;
+        bloom_contains_batch(b, keys + i, m, passed);
+        for(j = k = 0; j < m; j++){
+            found[i + j] = 0;
+            if(passed[j]){
+                maybe[k] = keys[i + j];
+                where[k++] = i + j;
+            }
+        }
+        search(dict, maybe, k, passed);
+        for(j = 0; j < k; j++){
+            found[where[j]] = passed[j];
+            if(!passed[j]){
+                false_positives++;
+            }
+        }
+        for(j = 0; j < m; j++){
+            if(!found[i + j]){
+                negatives++;
+            }
+        }
+    }
+    __atomic_fetch_add(&b->negatives, negatives, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&b->passed, false_positives, __ATOMIC_RELAXED);
+}
+
+/**
+ * how often the filter let through a key bloom_search_batch did not
+ * find.
+ *
+ * @param b the filter.
+ *
+ * @return the percentage of the keys not found that the filter let
+ * through, 0 if every key was found.
+ */
+double bloom_false_positives(bloom b){
+    return b->negatives > 0 ? 100.0 * b->passed / b->negatives : 0.0;
+}
+
+/**
+ * frees the filter.
+ *
+ * @param b the filter to free.
+ */
+void bloom_free(bloom b){
+    free(b->mem);
+    free(b);
+}
@@ -0,0 +1,27 @@
+/********************************************************\
+ * bloom.h -- declaration file for bloom.c              *
+ *                                                      *
+ * Authors:    James Douglas, Paul Souter,              *
+ *             Ryan Swanepoel                           *
+ *                                                      *
+ * Purpose:    to declare each function in bloom.c      *
+ *                                                      *
+\********************************************************/
+
+#ifndef BLOOM_H_
+#define BLOOM_H_
+
+typedef struct bloomrec *bloom;
+
+extern bloom bloom_new(int keys, int bits_per_key);
+extern void bloom_add(bloom b, const char *key);
+extern int bloom_contains(bloom b, const char *key);
+extern void bloom_contains_batch(bloom b, char **keys, int n, int *results);
+extern void bloom_search_batch(bloom b,
+                               void search(void *dict, char **words, int n,
+                                           int *found),
+                               void *dict, char **keys, int n, int *found);
+extern double bloom_false_positives(bloom b);
+extern void bloom_free(bloom b);
+
+#endif
@@ -6,19 +6,97 @@
  *             Ryan Swanepoel                           *   
  *                                                      *   
  * Purpose:    to build a hash table using linear       *
- *             probing or double hashing                *
+ *             probing, double hashing or cuckoo        *
+ *             hashing                                  *
  *                                                      * 
  * Usage:                                               *   
  *      ./htable [OPTION]... <STDIN>                    *   
 \********************************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include "mylib.h"
 #include "htable.h"
+#include "bloom.h"
+#include "phash.h"
 #include <getopt.h>
 #include <string.h>
-#include <time.h>
+#include <pthread.h>
+
+/* one piece of the input and the table a thread counts it into */
+struct count_job {
+    char *start;
+    size_t len;
+    htable tab;
+    int dropped;/*words that did not fit in the table*/
+};
+
+/* options that only have a long form */
+static struct option long_options[] = {
+    {"load", required_argument, NULL, 'L'},
+    {"save", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0}
+};
+
+/* the Bloom filter -c consults before the table when -b is given */
+static bloom filter = NULL;
+
+/* the minimal perfect hash -c searches instead of the table when -m
+   is given, and the keys and frequencies it is built from */
+static phash perfect = NULL;
+static char **perfect_keys = NULL;
+static int *perfect_freqs = NULL;
+static int perfect_n = 0;
+static int perfect_cap = 0;
+
+/**
+ * adds a key of the table to the Bloom filter.
+ *
+ * @param freq the frequency of the key
+ * @param word the key
+ */
+static void add_to_filter(int freq, char *word) {
+    (void) freq;
+    bloom_add(filter, word);
+}
+
+/**
+ * collects a key of the table and its frequency, for building the
+ * perfect hash.
+ *
+ * @param freq the frequency of the key
+ * @param word the key
+ */
+static void collect_key(int freq, char *word) {
+    if(perfect_n == perfect_cap){
+        perfect_cap = (perfect_cap == 0) ? 1024 : 2 * perfect_cap;
+        perfect_keys = erealloc(perfect_keys,
+                                perfect_cap * sizeof perfect_keys[0]);
+        perfect_freqs = erealloc(perfect_freqs,
+                                 perfect_cap * sizeof perfect_freqs[0]);
+    }
+    perfect_keys[perfect_n] = word;
+    perfect_freqs[perfect_n++] = freq;
+}
+
+/**
+ * searches the perfect hash if there is one, otherwise the table.
+ *
+ * @param dict the table.
+ * @param words the words to look up.
+ * @param n the number of words.
+ * @param found set to the frequency of each word, 0 if it is not in the
+ * dictionary.
+ */
+static void search_dict(void *dict, char **words, int n, int *found){
+    if(perfect != NULL){
+        phash_search_batch(perfect, words, n, found);
+    }else{
+        htable_search_batch(dict, words, n, found);
+    }
+}
 
 /**
  * prints the frequency and key of each item in the table
@@ -31,25 +109,143 @@ static void print_info(int freq, char *word) {
 }
 
 /**
- *check if given number is a prime number
+ * looks up a batch of words in a table for check_words, through the
+ * Bloom filter if there is one.
+ *
+ * @param dict the table.
+ * @param words the words to look up.
+ * @param n the number of words.
+ * @param found set to the frequency of each word, 0 if it is not in the
+ * table.
+ */
+static void lookup_words(void *dict, char **words, int n, int *found){
+    bloom_search_batch(filter, search_dict, dict, words, n, found);
+}
+
+/**
+ * Thread body for a sharded count, inserts every word of its piece
+ * of the input into its own table.
  *
- * @param number the number to check
+ * @param arg the count_job to work on.
  *
- * @return 1 if number is a prime, 0 if not
+ * @return NULL.
  */
-int IsPrime(int number) {
-    if (number <= 3 && number > 1) {
-        return 1;
-    }else if (number%2==0 || number%3==0){ 
-        return 0;
-    }else {
-        int i;
-        for (i=5; i*i<=number; i+=6) {
-            if (number % i == 0 || number%(i + 2) == 0) 
-                return 0;
-        }
-        return 1; 
+static void *count_piece(void *arg){
+    struct count_job *job = arg;
+    char *word;
+    wordreader in = wordreader_mem(job->start, job->len);
+    while(wordreader_next(in, &word) != EOF){
+        if(htable_insert(job->tab, word) == 0){
+            job->dropped++;
+        }
+    }
+    wordreader_close(in);
+    return NULL;
+}
+
+/**
+ * Counts the words of all of stdin using several threads. The input is
+ * split into pieces at word boundaries. Normally each thread counts one
+ * piece into a table of its own, then the tables are merged in input
+ * order, which gives the same table as counting with one thread. With
+ * shared set, every thread counts straight into one shared table, which
+ * grows level by level as it fills while the threads are still
+ * counting, and whose levels are put together into one table once
+ * every thread is done.
+ *
+ * @param capacity the initial size of each table.
+ * @param method the hashing method to use.
+ * @param hash the hash function to use.
+ * @param load the maximum load factor of each table.
+ * @param threads the number of threads to use.
+ * @param shared whether to use one shared table.
+ * @param pow2 whether to size the tables in powers of two.
+ * @param dropped set to the number of words that could not be counted.
+ *
+ * @return the merged or shared table, NULL if it could not be shared.
+ */
+static htable count_parallel(int capacity, hashing_t method, hashfn_t hash,
+                             double load, int threads, int shared, int pow2,
+                             int *dropped){
+    size_t size, pos = 0, end;
+    char *buf = map_stream(stdin, &size);
+    int mapped = (buf != NULL);
+    struct count_job *jobs = emalloc(threads * sizeof jobs[0]);
+    pthread_t *ids = emalloc(threads * sizeof ids[0]);
+    htable result = NULL;
+    int i, n = 0;
+
+    if(!mapped){
+        buf = read_stream(stdin, &size);
+    }
+    *dropped = 0;
+    if(shared){
+        result = htable_new(capacity, method, hash);
+        if(pow2){
+            htable_set_pow2(result);
+        }
+        htable_set_max_load(result, load);
+        if(!htable_set_shared(result)){
+            htable_free(result);
+            free(ids);
+            free(jobs);
+            if(mapped){
+                unmap_stream(buf, size);
+            }else{
+                free(buf);
+            }
+            return NULL;
+        }
+    }
+    for(i = 0; i < threads && pos < size; i++){
+        end = next_boundary(buf, size, pos + (size - pos) / (threads - i));
+        jobs[n].start = buf + pos;
+        jobs[n].len = end - pos;
+        jobs[n].dropped = 0;
+        if(shared){
+            jobs[n].tab = result;
+        }else{
+            jobs[n].tab = htable_new(capacity, method, hash);
+            htable_set_max_load(jobs[n].tab, load);
+            if(pow2){
+                htable_set_pow2(jobs[n].tab);
+            }
+        }
+        if(pthread_create(&ids[n], NULL, count_piece, &jobs[n]) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        n++;
+        pos = end;
     }
+    if(n == 0 && result == NULL){
+        result = htable_new(capacity, method, hash);
+        htable_set_max_load(result, load);
+        if(pow2){
+            htable_set_pow2(result);
+        }
+    }
+    for(i = 0; i < n; i++){
+        pthread_join(ids[i], NULL);
+        *dropped += jobs[i].dropped;
+        if(result == NULL){
+            result = jobs[i].tab;
+        }else if(!shared){
+            htable_merge(result, jobs[i].tab);
+            htable_free(jobs[i].tab);
+        }
+    }
+    if(shared){
+        htable_end_shared(result);
+    }
+    free(ids);
+    free(jobs);
+    if(mapped){
+        unmap_stream(buf, size);
+    }else{
+        free(buf);
+    }
+    return result;
 }
 
 /**
@@ -58,19 +254,36 @@ int IsPrime(int number) {
  * @param argc the number of arguments given
  * @param argv the arguments given in the command line when running the program.
  *
- * @return EXIT_SUCCESS the program has finished successfully.
+ * @return EXIT_SUCCESS the program has finished successfully, or
+ * EXIT_FAILURE if some words could not be counted.
  */
 int main(int argc, char **argv){
-    const char *optstring = "c:deps:t:h";
-    FILE *fp;
+    const char *optstring = "2ab:c:degH:j:kl:mpP:rs:t:Th";
+    FILE *fp = NULL;
     
     htable tab = NULL;
     char option;
     int capacity = 113;
     int c,e,p,s,unknown;
+    int threads = 1;
+    int tokenizers = 0;
+    int shared = 0;
+    int dropped = 0;
+    int status = EXIT_SUCCESS;
+    int bits_per_key = 0;
+    int m = 0;
+    int pow2 = 0;
+    int timings = 0;
+    char *load_file = NULL;
+    char *save_file = NULL;
+    FILE *image;
+    double load = 0.0;
     hashing_t method = LINEAR_P;
-    char word[256];
-    clock_t start,end;
+    hashfn_t hash = HASH_31;
+    char *word;
+    wordreader in;
+    pipeline pin;
+    double start,end;
     double timeBuild,timeSearch;
 
     /*initialisation of variables for  the switch operation */
@@ -82,8 +295,32 @@ int main(int argc, char **argv){
     unknown = 0;
 
     /* decides which cases have been called.*/
-    while ((option = getopt(argc,argv,optstring)) != EOF){
+    while ((option = getopt_long(argc,argv,optstring,long_options,NULL))
+           != EOF){
         switch (option) {
+            case 'L':/*--load file*/
+                /* use the table saved in file instead of reading stdin*/
+                load_file = optarg;
+                break;
+            case 'S':/*--save file*/
+                /* save the table to file once it is built*/
+                save_file = optarg;
+                break;
+            case '2':/*-2*/
+                /* size the table in powers of two, finding slots by
+                   multiplying and masking instead of dividing*/
+                pow2 = 1;
+                break;
+            case 'a':/*-a*/
+                /* all threads count into one table, claiming slots
+                   with atomic operations instead of merging tables*/
+                shared = 1;
+                break;
+            case 'b':/*-b bits*/
+                /* put a Bloom filter of this many bits per key in
+                   front of the table when checking words*/
+                bits_per_key = atoi(optarg);
+                break;
             case 'c':/*-c filename*/
                 /*ignore -p option
                   process two groups of words,
@@ -105,11 +342,59 @@ int main(int argc, char **argv){
                   display index, frequency, stats and the key if it exists*/
                 e=1;
                 break;
+            case 'g':/*-g*/
+                /* use group probing, checking the control bytes of a
+                   whole group of slots at once before any key*/
+                method = SWISS;
+                break;
+            case 'H':/*-H hash*/
+                /* choose the hash function by name*/
+                if(!htable_hash_by_name(optarg, &hash)){
+                    fprintf(stderr, "unknown hash function: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'j':/*-j threads*/
+                /* count the words from stdin with this many threads,
+                   each into its own table, then merge the tables*/
+                threads = atoi(optarg);
+                if(threads < 1){
+                    threads = 1;
+                }
+                break;
+            case 'k':/*-k*/
+                /* use cuckoo hashing, every key is in one of two
+                   buckets of a cache line each, or a small stash*/
+                method = CUCKOO;
+                break;
+            case 'l':/*-l load*/
+                /*grow the table once this fraction of it is full,
+                  anything outside (0,1] uses the default*/
+                load = atof(optarg);
+                break;
+            case'm':/*-m*/
+                /* with -c, compile the finished dictionary into a
+                   minimal perfect hash and search that instead*/
+                m=1;
+                break;
             case'p':/*-p*/
                 /*print stats info using functions in print-stats.txt
                   instead of printing frequencies and words*/
                 p=1;
                 break;
+            case'P':/*-P tokenizers*/
+                /* read stdin on one thread and tokenize it on this many
+                   while this thread fills the table*/
+                tokenizers = atoi(optarg);
+                if(tokenizers < 1){
+                    tokenizers = 1;
+                }
+                break;
+            case'r':/*-r*/
+                /* use Robin Hood hashing, keys stay near their home slot
+                   so unsuccessful searches can stop early*/
+                method = ROBIN_HOOD;
+                break;
             case's':/*-s snapshots*/
                 /*display upto the given number of stats snapshots
                   when given -p as an argument
@@ -118,18 +403,18 @@ int main(int argc, char **argv){
                 s = atoi(optarg);
                 break;
             case't':/*-t tablesize*/
-                /*use the first prime >= tablesize as the size of hash table
-                  assume tablesize>0 */
+                /*htable_new uses the first prime >= tablesize as the size
+                  of hash table, assume tablesize>0 */
                 capacity = atoi(optarg);
                 if(capacity == 0){
                     capacity = 113;
-                }else if(capacity == 1){
-                    capacity = 2;
-                }
-                while(!IsPrime(capacity)){
-                    capacity++;
                 }
                 break;
+            case'T':/*-T*/
+                /* with -p, also time each hash function on the keys,
+                   which varies from run to run*/
+                timings = 1;
+                break;
             default:/*OR -h*/
                 /*print a help message describing how to use the program*/
                 printf("%s \n\n","Usage : ./htable [OPTION]... <STDIN>");
@@ -140,6 +425,15 @@ int main(int argc, char **argv){
                        " table, before being printed out");
                 printf("%s\n\n","alongside their frequencies to stdout.");
 
+                printf(" %s %s %s%s\n","-2","         ","Size the table in",
+                       " powers of two (no division)");
+                printf(" %s %s %s%s\n","-a","         ","Count into one table",
+                       " shared by all -j threads");
+                printf("              %s\n","instead of merging tables");
+
+                printf(" %s %s %s%s\n","-b","BITS     ","With -c, reject",
+                       " unknown words with a Bloom");
+                printf("              %s\n","filter of BITS bits per key first");
                 printf(" %s %s %s%s\n","-c","FILENAME ","Check spelling of",
                        " words in FILENAME using words");
                 printf("              %s%s\n","from stdin as dictionary. ",
@@ -150,51 +444,164 @@ int main(int argc, char **argv){
                        " (linear probing is the default)");
                 printf(" %s %s %s%s\n","-e","         ","Display entire ",
                        "contents of hash table on stderr");
+                printf(" %s %s %s%s\n","-g","         ","Use group probing",
+                       " (SIMD control byte groups)");
+                printf(" %s %s %s%s\n","-H","HASH     ","Hash function: 31",
+                       " (default), fnv1a, word64, xxh");
+                printf(" %s %s %s%s\n","-j","THREADS  ","Count the words",
+                       " from stdin using THREADS threads");
+                printf("              %s\n","(and check FILENAME with them)");
+                printf(" %s %s %s%s\n","-k","         ","Use cuckoo hashing",
+                       " (bounded search time)");
+                printf(" %s %s %s%s\n","-l","LOAD     ","Grow the table when",
+                       " it is LOAD full (default 0.7)");
+                printf(" %s %s %s%s\n","-m","         ","With -c, search a",
+                       " minimal perfect hash of the");
+                printf("              %s\n","dictionary instead of the table");
                 printf(" %s %s %s%s\n","-p","         ","Print stats info",
                        " instead of frequencies & words");
+                printf("              %s\n","and compare the hash functions");
+                printf("              %s\n","(with -T, time them too)");
+                printf(" %s %s %s%s\n","-P","THREADS  ","Read stdin on one",
+                       " thread, tokenize it on THREADS");
+                printf("              %s\n","and fill the table as words arrive");
+                printf("              %s\n","(not with -j or -a)");
+                printf(" %s %s %s%s\n","-r","         ","Use Robin Hood",
+                       " hashing (fast unsuccessful searches)");
                 printf(" %s %s %s%s\n","-s","SNAPSHOTS","Show SNAPSHOTS ",
                        "stats snapshots (if -p is used)");
-                printf(" %s %s %s%s\n\n","-t","TABLESIZE","Use the first prime",
-                       " >= TABLESIZE as htable size");
+                printf(" %s %s %s%s\n","-t","TABLESIZE","Use the first prime",
+                       " >= TABLESIZE as initial htable size");
+                printf("              %s\n","(power of two with -2)");
+                printf(" %s %s %s%s\n\n","-T","         ","With -p, time each",
+                       " hash function on the keys");
                 printf(" %s %s %s\n","-h","         ","Display this message");
+                printf("\n %s %s%s\n","--load FILE","Use the table saved",
+                       " in FILE instead of reading stdin");
+                printf(" %s %s%s\n","--save FILE","Save the table to FILE",
+                       " once it is built");
 
                 /* program finished successfully */
                 return EXIT_SUCCESS;
         }
     }
+    if(tokenizers > 0 && (threads > 1 || shared)){
+        fprintf(stderr, "-P cannot be used with -j or -a\n");
+        return EXIT_FAILURE;
+    }
     /* regardless of cases run this section first */
-    tab = htable_new(capacity,method);
-    start = clock();            /* start clock */
-    while(getword(word, sizeof word, stdin) != EOF){
-        htable_insert(tab, word);
+    start = wall_time();        /* start clock */
+    if(load_file != NULL){
+        image = fopen(load_file, "rb");
+        if(image == NULL){
+            perror(load_file);
+            return EXIT_FAILURE;
+        }
+        tab = htable_load(image);
+        fclose(image);
+        if(tab == NULL){
+            fprintf(stderr, "%s: not a saved hash table\n", load_file);
+            return EXIT_FAILURE;
+        }
+    }else if(threads > 1 || shared){
+        tab = count_parallel(capacity,method,hash,load,threads,shared,pow2,
+                             &dropped);
+        if(tab == NULL){
+            fprintf(stderr, "-a needs linear probing or double hashing\n");
+            return EXIT_FAILURE;
+        }
+    }else if(tokenizers > 0){
+        tab = htable_new(capacity,method,hash);
+        htable_set_max_load(tab,load);
+        if(pow2){
+            htable_set_pow2(tab);
+        }
+        pin = pipeline_open(stdin, tokenizers);
+        while(pipeline_next(pin, &word) != EOF){
+            if(htable_insert(tab, word) == 0){
+                dropped++;
+            }
+        }
+        pipeline_close(pin);
+    }else{
+        tab = htable_new(capacity,method,hash);
+        htable_set_max_load(tab,load);
+        if(pow2){
+            htable_set_pow2(tab);
+        }
+        in = wordreader_open(stdin);
+        while(wordreader_next(in, &word) != EOF){
+            if(htable_insert(tab, word) == 0){
+                dropped++;
+            }
+        }
+        wordreader_close(in);
+    }
+    if(dropped > 0){
+        fprintf(stderr, "table full, %d words not counted\n", dropped);
+        status = EXIT_FAILURE;
+    }
+    if(c == 1 && bits_per_key > 0){
+        filter = bloom_new(htable_num_keys(tab), bits_per_key);
+        htable_print(tab, add_to_filter);
+    }
+    if(c == 1 && m == 1){
+        htable_print(tab, collect_key);
+        perfect = phash_new(perfect_keys, perfect_freqs, perfect_n);
+        if(perfect == NULL){
+            fprintf(stderr, "could not build a perfect hash,"
+                    " searching the table\n");
+        }
+        free(perfect_keys);
+        free(perfect_freqs);
+    }
+    end = wall_time();          /* end clock */
+    timeBuild = end-start;      /* time taken */
+    if(save_file != NULL){
+        image = fopen(save_file, "wb");
+        if(image == NULL || !htable_save(tab, image)){
+            perror(save_file);
+            return EXIT_FAILURE;
+        }
+        fclose(image);
     }
-    end = clock();              /* end clock */
-    timeBuild = (end-start)/(double)CLOCKS_PER_SEC; /* time taken */
     /* if e case was enabled */
     if(e == 1){
         htable_print_entire_table(tab);
     }
     /* if c case was enabled */
     if(c==1){
-        start = clock();        /* start clock */
-        while(getword(word, sizeof word, fp) != EOF){
-            if(htable_search(tab,word) == 0){
-                printf("%s\n",word);
-                unknown++;
-            }
-        }
-        end = clock();          /* end clock */
-        timeSearch = (end-start)/(double)CLOCKS_PER_SEC; /* time taken */
+        start = wall_time();    /* start clock */
+        /* the table is only read from now, so the words can be
+           checked on all -j threads */
+        unknown = check_words(fp, threads, lookup_words, tab, stdout);
+        end = wall_time();      /* end clock */
+        timeSearch = end-start; /* time taken */
 
         /* print out details from making the table */
         printf("%s\t%s%f\n","Fill time",": ",timeBuild);
         printf("%s\t%s%f\n","Search time",": ",timeSearch);
         printf("%s\t%s%d\n","unknown words","= ",unknown);
+        if(filter != NULL){
+            printf("%s\t%s%d bits/key, %.2f%% false positives\n",
+                   "Bloom filter",": ",bits_per_key,
+                   bloom_false_positives(filter));
+            bloom_free(filter);
+        }
+        if(perfect != NULL){
+            printf("%s\t%s%.2f bytes/key\n","Perfect hash",": ",
+                   perfect_n > 0
+                   ? (double) phash_size(perfect) / perfect_n : 0.0);
+            phash_free(perfect);
+        }
 
         /* close the file */
         fclose(fp);
     }else if(p==1){ /* c==0 */
         htable_print_stats(tab,stdout,s);
+        if(timings){
+            htable_print_hash_times(tab,stdout);
+        }
     }else{   /*c==0 && p==0  */
         htable_print(tab,print_info);
     }
@@ -202,6 +609,6 @@ int main(int argc, char **argv){
     /* free the table */
     htable_free(tab);
     
-    /* program finishes successfully */
-    return EXIT_SUCCESS;
+    /* program finishes, unsuccessfully if words were not counted */
+    return status;
 }
@@ -6,7 +6,8 @@
  *             Ryan Swanepoel                           *   
  *                                                      *   
  * Purpose:    to build a hash table using linear       *
- *             probing or double hashing                *
+ *             probing, double hashing or cuckoo        *
+ *             hashing                                  *
  *                                                      *
 \********************************************************/
 
@@ -15,147 +16,1707 @@
 #include "htable.h"
 #include "mylib.h"
 #include <string.h>
+#include <time.h>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* one slot of the table, the full hash is kept so that probes can
+   skip the strcmp for keys that cannot match. The key is an offset
+   into the table's text rather than a pointer, so a slot is 12 bytes
+   and the buckets mean the same wherever they are, as in an image */
+struct bucket{
+    uint32_t hash;
+    int32_t freq;
+    uint32_t key;/*offset of the key in text, NO_KEY if the slot is empty*/
+};
+
+#define NO_KEY 0xFFFFFFFFu
+/* the key of a slot of a shared table that was found empty once the
+   table was full, telling anyone whose key would have gone there that
+   it is in the next level instead */
+#define SEALED 0xFFFFFFFEu
 
 struct htablerec{
     int capacity;
     int num_keys;
-    char** keys;
-    int *freq;
-    int *stats;/*colisions for each key*/
+    struct bucket *buckets;
+    void *buckets_mem;/*what was allocated for buckets, NULL if in image*/
+    char *text;/*the keys in the order they were first seen, each ended
+                 by a '\0'*/
+    size_t text_size;
+    size_t text_cap;/*0 while text is the image's, which is not grown*/
+    size_t loaded;/*how much of text came from htable_load*/
+    int32_t *stats;/*colisions for each key, in insertion order*/
     hashing_t method;
+    hashfn_t hash;
+    double max_load;/*grow once num_keys/capacity passes this*/
+    unsigned char *ctrl;/*control byte per slot, SWISS only*/
+    int shared;/*set once threads may insert and search at the same time*/
+    htable next;/*the larger level a full shared table passes keys on to*/
+    char *image;/*the snapshot the keys are in, if loaded by htable_load*/
+    size_t image_size;
+    int image_mapped;
+    int stashed;/*keys in the stash, CUCKOO only*/
+    int pow2;/*set if slots are found by multiplying and masking*/
+    int in_image;/*set while the buckets and stats are the image's*/
+    int asked;/*the capacity htable_new was given, before rounding*/
+};
+
+#define DEFAULT_LOAD 0.7
+
+#define IS_LINEAR(x) ((NULL == (x)) || (LINEAR_P == (x)->method))
+#define IS_DOUBLE(x) ((NULL != (x)) && (DOUBLE_H == (x)->method))
+#define IS_ROBIN(x) ((NULL != (x)) && (ROBIN_HOOD == (x)->method))
+#define IS_SWISS(x) ((NULL != (x)) && (SWISS == (x)->method))
+#define IS_CUCKOO(x) ((NULL != (x)) && (CUCKOO == (x)->method))
+
+/* the buckets are aligned to this, and a CUCKOO bucket fills exactly
+   one, so a CUCKOO lookup touches at most two cache lines of buckets,
+   and the stash only once a key has been put there */
+#define CACHE_LINE 64
+
+/* a CUCKOO table is capacity / CUCKOO_WAYS buckets of CUCKOO_WAYS
+   slots after which come CUCKOO_STASH slots for keys that found no
+   room in either of their buckets after CUCKOO_KICKS displacements.
+   The stash is as large as a bucket, so it is one more line */
+#define CUCKOO_WAYS 4
+#define CUCKOO_STASH CUCKOO_WAYS
+#define CUCKOO_KICKS 500
+
+/* a CUCKOO bucket, which fills a whole cache line. Slot i of a CUCKOO
+   table is slot i % CUCKOO_WAYS of line i / CUCKOO_WAYS. The rest of
+   the line holds the high half of each key's 64-bit hash, which
+   chooses its second bucket, so a key can be moved there without
+   hashing it again */
+struct cuckoo_line{
+    struct bucket slot[CUCKOO_WAYS];
+    uint32_t alt[CUCKOO_WAYS];
+};
+
+/**
+ * Finds slot i of some buckets, which for a CUCKOO table are kept a
+ * line to each bucket rather than one after another.
+ *
+ * @param buckets the first bucket.
+ * @param cuckoo whether the buckets are a CUCKOO table's.
+ * @param i the slot number.
+ *
+ * @return the slot.
+ */
+static struct bucket *slot_in(struct bucket *buckets, int cuckoo,
+                              unsigned int i){
+    if (cuckoo){
+        return &((struct cuckoo_line *) buckets)[i / CUCKOO_WAYS]
+            .slot[i % CUCKOO_WAYS];
+    }
+    return &buckets[i];
+}
+
+/**
+ * Finds how many bytes the buckets of a table take.
+ *
+ * @param cuckoo whether the table is a CUCKOO table.
+ * @param capacity the capacity of the table.
+ *
+ * @return the size of its buckets.
+ */
+static size_t buckets_size(int cuckoo, size_t capacity){
+    if (cuckoo){
+        return capacity / CUCKOO_WAYS * sizeof (struct cuckoo_line);
+    }
+    return capacity * sizeof (struct bucket);
+}
+
+#define SLOT(h, i) slot_in((h)->buckets, IS_CUCKOO(h), (i))
+#define CUCKOO_ALT(h, i) (&((struct cuckoo_line *) (h)->buckets) \
+                          [(i) / CUCKOO_WAYS].alt[(i) % CUCKOO_WAYS])
+
+/* bytes of key text set aside for each slot of a level of a shared
+   table, whose text cannot be moved to grow it. Keys of up to 15
+   characters on average fit even in a level that is completely full,
+   and a level whose text runs out is passed over like a full one */
+#define SHARED_TEXT 16
+
+/* SWISS control bytes: the top bit marks a slot that holds no key,
+   otherwise the low 7 bits are the top 7 bits of the key's hash */
+#define CTRL_EMPTY 0x80
+#define CTRL_H2(hash) ((unsigned char) ((hash) >> 25))
+
+/* number of slots whose control bytes are checked at once */
+#if defined(__AVX2__)
+#define GROUP_WIDTH 32
+#else
+#define GROUP_WIDTH 16
+#endif
+
+/* the start of a table saved by htable_save. The buckets, the stats,
+   the control bytes if there are any and the text follow it in that
+   order, all just as they are in memory. It is padded to CACHE_LINE
+   so that the buckets of a mapped image start a cache line */
+struct image_header{
+    char magic[8];
+    uint32_t byte_order;/*IMAGE_ORDER as written by the saving machine*/
+    uint32_t capacity;
+    uint32_t num_keys;
+    uint32_t method;
+    uint32_t hash;
+    uint32_t group_width;/*GROUP_WIDTH when saved, 0 if no control bytes*/
+    uint32_t pow2;
+    double max_load;
+    uint64_t keys_size;
+    uint32_t pad[2];
+};
+
+#define IMAGE_MAGIC "HTABLE4"
+#define IMAGE_ORDER 0x01020304u
+
+/* number of keys htable_search_batch hashes and prefetches before it
+   resolves any of them */
+#define SEARCH_BATCH 16
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) 0)
+#endif
+
+/* 2^32 divided by the golden ratio, multiplying a hash by it mixes
+   the low bits of the hash into the high bits */
+#define FIB_MULT 2654435769u
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define FNV64_OFFSET UINT64_C(14695981039346656037)
+#define FNV64_PRIME UINT64_C(1099511628211)
+#define MIX_K1 UINT64_C(0xff51afd7ed558ccd)
+#define MIX_K2 UINT64_C(0xc4ceb9fe1a85ec53)
+#define XXH_P1 UINT64_C(0x9E3779B185EBCA87)
+#define XXH_P2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_P3 UINT64_C(0x165667B19E3779F9)
+#define XXH_P4 UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_P5 UINT64_C(0x27D4EB2F165667C5)
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/**
+ * FNV-1a, xor in each byte then multiply by the FNV prime. The low 32
+ * bits are the 32-bit FNV-1a and the high 32 the top of the 64-bit one.
+ *
+ * @param word the word to convert.
+ * @param len the length of word.
+ * @return result the integer representation of the word.
+ */
+static uint64_t hash_fnv1a(const char *word, size_t len){
+    unsigned int result = FNV_OFFSET;
+    uint64_t wide = FNV64_OFFSET;
+    size_t i;
+    for (i = 0; i < len; i++){
+        result = (result ^ (unsigned char) word[i]) * FNV_PRIME;
+        wide = (wide ^ (unsigned char) word[i]) * FNV64_PRIME;
+    }
+    return (wide & ~UINT64_C(0xFFFFFFFF)) | result;
+}
+
+/**
+ * Reads up to 8 bytes of a word into a 64-bit integer, padding
+ * with zeros, without needing the bytes to be aligned.
+ *
+ * @param p the bytes to read.
+ * @param n how many bytes to read, at most 8.
+ * @return the bytes as an integer.
+ */
+static uint64_t read_word(const char *p, size_t n){
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    return w;
+}
+
+/**
+ * Final avalanche step of MurmurHash3, with the high half folded into
+ * the low half.
+ *
+ * @param x the 64-bit value to mix.
+ * @return the mixed value, whose low 32 bits are the folded hash.
+ */
+static uint64_t avalanche64(uint64_t x){
+    x ^= x >> 33;
+    x *= MIX_K1;
+    x ^= x >> 33;
+    x *= MIX_K2;
+    x ^= x >> 33;
+    return x ^ (x >> 32);
+}
+
+/**
+ * Final avalanche step of MurmurHash3, folded down to 32 bits.
+ *
+ * @param x the 64-bit value to mix.
+ * @return the mixed value.
+ */
+static unsigned int mix64(uint64_t x){
+    return (unsigned int) avalanche64(x);
+}
+
+/**
+ * The original hash, each character added to 31 times the hash so far.
+ * It is worked out in 64 bits, the low 32 of which are the 32-bit hash.
+ * The high 32 are zero for short words, so they are taken from the sum
+ * mixed again instead.
+ *
+ * @param word the word to convert.
+ * @param len the length of word.
+ * @return result the integer representation of the word.
+ */
+static uint64_t hash_31(const char *word, size_t len){
+    uint64_t result = 0;
+    size_t i;
+    for (i = 0; i < len; i++){
+        result = (word[i] + 31*result);
+    }
+    return (avalanche64(result) & ~UINT64_C(0xFFFFFFFF))
+        | (result & UINT64_C(0xFFFFFFFF));
+}
+
+/**
+ * Word-at-a-time hash, folding 8 bytes per multiply and mixing the
+ * result once at the end.
+ *
+ * @param word the word to convert.
+ * @param len the length of word.
+ * @return result the integer representation of the word.
+ */
+static uint64_t hash_word64(const char *word, size_t len){
+    uint64_t result = len * MIX_K2;
+    while (len >= 8){
+        result = ROTL64((result ^ read_word(word, 8)) * MIX_K1, 29);
+        word += 8;
+        len -= 8;
+    }
+    if (len > 0){
+        result = (result ^ read_word(word, len)) * MIX_K1;
+    }
+    return avalanche64(result);
+}
+
+/**
+ * A single lane of xxHash64: each 8 bytes go through the xxHash
+ * round and the result gets the xxHash avalanche.
+ *
+ * @param word the word to convert.
+ * @param len the length of word.
+ * @return result the integer representation of the word.
+ */
+static uint64_t hash_xxh(const char *word, size_t len){
+    uint64_t result = XXH_P5 + len;
+    uint64_t lane;
+    while (len >= 8){
+        lane = ROTL64(read_word(word, 8) * XXH_P2, 31) * XXH_P1;
+        result = ROTL64(result ^ lane, 27) * XXH_P1 + XXH_P4;
+        word += 8;
+        len -= 8;
+    }
+    if (len >= 4){
+        result ^= read_word(word, 4) * XXH_P1;
+        result = ROTL64(result, 23) * XXH_P2 + XXH_P3;
+        word += 4;
+        len -= 4;
+    }
+    while (len > 0){
+        result ^= (unsigned char) *word++ * XXH_P5;
+        result = ROTL64(result, 11) * XXH_P1;
+        len--;
+    }
+    result ^= result >> 33;
+    result *= XXH_P2;
+    result ^= result >> 29;
+    result *= XXH_P3;
+    result ^= result >> 32;
+    return result;
+}
+
+/* the built in hash functions, indexed by hashfn_t. Each gives 64
+   bits, the low 32 of which are the key's hash and the high 32 choose
+   a CUCKOO key's second bucket */
+static const struct{
+    const char *name;
+    uint64_t (*fn)(const char *word, size_t len);
+} hash_functions[] = {
+    {"31", hash_31},
+    {"fnv1a", hash_fnv1a},
+    {"word64", hash_word64},
+    {"xxh", hash_xxh}
 };
 
-#define IS_LINEAR(x) ((NULL == (x)) || (LINEAR_P == (x)->method))
-#define IS_DOUBLE(x) ((NULL != (x)) && (DOUBLE_H == (x)->method))
+#define NUM_HASHES ((int) (sizeof hash_functions / sizeof hash_functions[0]))
+
+/**
+ * Converts a given character pointer into an integer using
+ * the table's hash function.
+ *
+ * @param h the table being used.
+ * @param word the word to convert.
+ * @return result the integer representation of the word.
+ */
+static unsigned int htable_word_to_int(htable h, char *word){
+    return (unsigned int) hash_functions[h->hash].fn(word, strlen(word));
+}
+
+/**
+ * Converts a given character pointer into the 64-bit hash the table's
+ * hash function gives, whose low 32 bits are what htable_word_to_int
+ * gives.
+ *
+ * @param h the table being used.
+ * @param word the word to convert.
+ * @return result the 64-bit hash of the word.
+ */
+static uint64_t htable_word_to_wide(htable h, char *word){
+    return hash_functions[h->hash].fn(word, strlen(word));
+}
+
+/**
+ * Looks up a hash function by the name htable_print_stats uses.
+ *
+ * @param name the name of the hash function.
+ * @param hash set to the matching hash function.
+ *
+ * @return 1 if the name was found, 0 if not.
+ */
+int htable_hash_by_name(const char *name, hashfn_t *hash){
+    int i;
+    for (i = 0; i < NUM_HASHES; i++){
+        if (strcmp(name, hash_functions[i].name) == 0){
+            *hash = (hashfn_t) i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Scales a hash to a number below n by multiplying rather than
+ * dividing: the hash is mixed by FIB_MULT and its top bits are kept,
+ * in proportion to n.
+ *
+ * @param hash the hash.
+ * @param n the number to scale to.
+ *
+ * @return a number from 0 to n - 1.
+ */
+static unsigned int fast_range(unsigned int hash, unsigned int n){
+    return (unsigned int) (((uint64_t) (unsigned int) (hash * FIB_MULT) * n)
+                           >> 32);
+}
+
+/**
+ * Finds the key of an occupied slot in the table's text.
+ *
+ * @param h the table being used.
+ * @param b the slot.
+ *
+ * @return the key.
+ */
+static char *bucket_key(htable h, const struct bucket *b){
+    return h->text + b->key;
+}
+
+/**
+ * Copies a key onto the end of the table's text, growing the text if
+ * it is full or still the image's.
+ *
+ * @param h the table to add the key to.
+ * @param str the key.
+ *
+ * @return the offset of the copy, or NO_KEY if the text would be too
+ * large for offsets to reach.
+ */
+static uint32_t text_add(htable h, const char *str){
+    size_t len = strlen(str) + 1;
+    size_t start = h->text_size;
+    size_t cap = 2 * h->text_cap;
+    char *text;
+    if (len >= NO_KEY - start){
+        return NO_KEY;
+    }
+    if (start + len > h->text_cap){
+        if (cap < 4096){
+            cap = 4096;
+        }
+        while (cap < start + len){
+            cap *= 2;
+        }
+        if (h->text_cap == 0){
+            text = emalloc(cap);
+            if (start > 0){
+                memcpy(text, h->text, start);
+            }
+            h->text = text;
+        }else{
+            h->text = erealloc(h->text, cap);
+        }
+        h->text_cap = cap;
+    }
+    memcpy(h->text + start, str, len);
+    h->text_size = start + len;
+    return (uint32_t) start;
+}
+
+/**
+ * Finds the home slot of a hash, where a search for its key starts.
+ *
+ * @param h the table being used.
+ * @param hash the hash of a key.
+ *
+ * @return the slot.
+ */
+static unsigned int htable_home(htable h, unsigned int hash){
+    if (h->pow2){
+        return fast_range(hash, h->capacity);
+    }
+    return hash % h->capacity;
+}
+
+/**
+ * Wraps a slot number that has run past the end of the table back
+ * round to the start, with a mask if the capacity is a power of two.
+ *
+ * @param h the table being used.
+ * @param i the slot number.
+ *
+ * @return the slot.
+ */
+static unsigned int htable_wrap(htable h, unsigned int i){
+    if (h->pow2){
+        return i & (h->capacity - 1);
+    }
+    return i % h->capacity;
+}
+
+/**
+ * Calculates the step size for the given key
+ *
+ * @param h the table being used.
+ * @param i_key the integer representation of a word.
+ *
+ * @return the step,1 if linear and claculated if double. A double
+ * hashing step in a table whose capacity is a power of two is odd, so
+ * that it still reaches every slot.
+ */
+static unsigned int htable_step(htable h, unsigned int i_key){
+    if (IS_DOUBLE(h) && h->pow2){
+        return (mix64(i_key) | 1) & (h->capacity - 1);
+    }else if (IS_DOUBLE(h)){
+        return 1 + (i_key % (h->capacity - 1));
+    }else{
+        return 1;
+    }
+}
+
+/**
+ * Compares the GROUP_WIDTH control bytes starting at p with b.
+ *
+ * @param p the first control byte of the group.
+ * @param b the byte to look for.
+ *
+ * @return a mask with bit j set if p[j] == b.
+ */
+static unsigned int group_match(const unsigned char *p, unsigned char b){
+#if defined(__AVX2__)
+    __m256i group = _mm256_loadu_si256((const __m256i *) p);
+    return (unsigned int) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(group, _mm256_set1_epi8((char) b)));
+#elif defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *) p);
+    return (unsigned int) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char) b)));
+#else
+    unsigned int mask = 0;
+    int j;
+    for (j = 0; j < GROUP_WIDTH; j++){
+        if (p[j] == b){
+            mask |= 1u << j;
+        }
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Returns the position of the lowest set bit of a non-zero mask.
+ *
+ * @param mask the mask to look at.
+ *
+ * @return the index of the lowest set bit.
+ */
+static int lowest_bit(unsigned int mask){
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int j = 0;
+    while (!(mask & 1u)){
+        mask >>= 1;
+        j++;
+    }
+    return j;
+#endif
+}
+
+/**
+ * Sets the control byte of slot i, keeping the copy of the first
+ * GROUP_WIDTH - 1 bytes past the end of the array up to date so
+ * that a group starting near the end can be loaded in one go.
+ *
+ * @param h the table being used.
+ * @param i the slot to set.
+ * @param c the new control byte.
+ */
+static void swiss_set_ctrl(htable h, unsigned int i, unsigned char c){
+    unsigned int j;
+    h->ctrl[i] = c;
+    for (j = i + h->capacity; j < (unsigned int) (h->capacity + GROUP_WIDTH
+                                                  - 1); j += h->capacity){
+        h->ctrl[j] = c;
+    }
+}
+
+/**
+ * Allocates the control bytes for a SWISS table, all marked empty.
+ *
+ * @param h the table to allocate control bytes for.
+ */
+static void swiss_new_ctrl(htable h){
+    h->ctrl = emalloc((h->capacity + GROUP_WIDTH - 1) * sizeof h->ctrl[0]);
+    memset(h->ctrl, CTRL_EMPTY, h->capacity + GROUP_WIDTH - 1);
+}
+
+/**
+ * Looks for a key in a SWISS table one group of control bytes at a
+ * time. Only slots whose control byte matches the key's 7 hash bits
+ * are compared, and the search stops at the first group with an
+ * empty slot since keys are never placed past one, or once every slot
+ * has been looked at.
+ *
+ * @param h the table to search.
+ * @param str the key to search for.
+ * @param result the hash of str.
+ * @param groups set to the number of groups passed over, may be NULL.
+ *
+ * @return the slot holding str, the empty slot str belongs in, or
+ * capacity if str is not in a table with no empty slot.
+ */
+static unsigned int swiss_find(htable h, char *str, unsigned int result,
+                               int *groups){
+    unsigned int pos = htable_home(h, result);
+    unsigned char h2 = CTRL_H2(result);
+    unsigned int mask, slot;
+    int n = 0;
+
+    while (n <= h->capacity / GROUP_WIDTH){
+        mask = group_match(h->ctrl + pos, h2);
+        while (mask != 0){
+            slot = htable_wrap(h, pos + lowest_bit(mask));
+            if (h->buckets[slot].hash == result &&
+                strcmp(bucket_key(h, &h->buckets[slot]), str) == 0){
+                if (groups != NULL){
+                    *groups = n;
+                }
+                return slot;
+            }
+            mask &= mask - 1;
+        }
+        mask = group_match(h->ctrl + pos, CTRL_EMPTY);
+        if (mask != 0){
+            if (groups != NULL){
+                *groups = n;
+            }
+            return htable_wrap(h, pos + lowest_bit(mask));
+        }
+        pos = htable_wrap(h, pos + GROUP_WIDTH);
+        n++;
+    }
+    if (groups != NULL){
+        *groups = n;
+    }
+    return h->capacity;
+}
+
+/**
+ * Finds how far the key in slot i sits from its home slot.
+ *
+ * @param h the table being used.
+ * @param i the occupied slot to look at.
+ *
+ * @return the number of slots between the key's home and i.
+ */
+static int htable_distance(htable h, unsigned int i){
+    unsigned int home = htable_home(h, h->buckets[i].hash);
+    return htable_wrap(h, i + h->capacity - home);
+}
+
+/**
+ * Robin Hood placement: walks forward from slot i, swapping the
+ * entry being placed with any resident that is closer to its home,
+ * until an empty slot takes whatever entry is left over.
+ *
+ * @param h the table to place the entry in.
+ * @param entry the bucket to place.
+ * @param i the slot to start at.
+ * @param dist how far slot i is from the entry's home.
+ *
+ * @return the distance from home the original entry ended up at.
+ */
+static int robin_hood_place(htable h, struct bucket entry, unsigned int i,
+                            int dist){
+    struct bucket temp;
+    int placed = -1;
+    int d;
+    while (h->buckets[i].key != NO_KEY){
+        d = htable_distance(h, i);
+        if (d < dist){
+            if (placed < 0){
+                placed = dist;
+            }
+            temp = h->buckets[i];
+            h->buckets[i] = entry;
+            entry = temp;
+            dist = d;
+        }
+        i = htable_wrap(h, i + 1);
+        dist++;
+    }
+    h->buckets[i] = entry;
+    return placed < 0 ? dist : placed;
+}
+
+/**
+ * Finds one of the two buckets a key may be kept in by a CUCKOO table.
+ * The first comes from the low half of the key's 64-bit hash and the
+ * second from the high half, so keys that share one bucket are no
+ * more likely than any others to share the other.
+ *
+ * @param h the table being used.
+ * @param bits the half of the key's hash to use.
+ *
+ * @return the first slot of the bucket.
+ */
+static unsigned int cuckoo_bucket(htable h, unsigned int bits){
+    unsigned int buckets = (h->capacity - CUCKOO_STASH) / CUCKOO_WAYS;
+    if (h->pow2){
+        return fast_range(bits, buckets) * CUCKOO_WAYS;
+    }
+    return bits % buckets * CUCKOO_WAYS;
+}
+
+/**
+ * Finds an empty slot in a CUCKOO bucket.
+ *
+ * @param h the table being used.
+ * @param b the first slot of the bucket.
+ *
+ * @return the empty slot, or -1 if the bucket is full.
+ */
+static int cuckoo_free_slot(htable h, unsigned int b){
+    int j;
+    for (j = 0; j < CUCKOO_WAYS; j++){
+        if (SLOT(h, b + j)->key == NO_KEY){
+            return b + j;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Looks for a key in a CUCKOO table. Keys are never removed, and a key
+ * only goes to its second bucket or the stash while its first bucket
+ * is full, so a first bucket with an empty slot ends the search. Any
+ * search touches at most the two buckets, and the stash only once a
+ * key has been put there.
+ *
+ * @param h the table to search.
+ * @param str the key to search for.
+ * @param result the hash of str.
+ * @param alt the high half of the 64-bit hash of str.
+ *
+ * @return the bucket holding str, or NULL if it is not in the table.
+ */
+static struct bucket *cuckoo_find(htable h, char *str, unsigned int result,
+                                  unsigned int alt){
+    struct bucket *b = SLOT(h, cuckoo_bucket(h, result));
+    int j;
+    for (j = 0; j < CUCKOO_WAYS; j++){
+        if (b[j].key == NO_KEY){
+            return NULL;
+        }
+        if (b[j].hash == result && strcmp(bucket_key(h, &b[j]), str) == 0){
+            return &b[j];
+        }
+    }
+    b = SLOT(h, cuckoo_bucket(h, alt));
+    for (j = 0; j < CUCKOO_WAYS; j++){
+        if (b[j].key != NO_KEY && b[j].hash == result
+            && strcmp(bucket_key(h, &b[j]), str) == 0){
+            return &b[j];
+        }
+    }
+    b = SLOT(h, h->capacity - CUCKOO_STASH);
+    for (j = 0; j < h->stashed; j++){
+        if (b[j].hash == result && strcmp(bucket_key(h, &b[j]), str) == 0){
+            return &b[j];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Puts an entry in a slot of a CUCKOO table.
+ *
+ * @param h the table being used.
+ * @param slot the slot.
+ * @param entry the bucket to put there.
+ * @param alt the high half of the 64-bit hash of its key.
+ */
+static void cuckoo_set(htable h, unsigned int slot, struct bucket *entry,
+                       uint32_t alt){
+    *SLOT(h, slot) = *entry;
+    *CUCKOO_ALT(h, slot) = alt;
+}
+
+/**
+ * Cuckoo placement: puts the entry in a free slot of its first or
+ * second bucket, or else displaces a resident of the bucket, which
+ * moves to its own other bucket, and so on. An entry still left over
+ * after CUCKOO_KICKS displacements goes to the stash.
+ *
+ * @param h the table to place the entry in.
+ * @param entry the bucket to place, set to whatever entry is left
+ * over if there is no room for it.
+ * @param alt the high half of the 64-bit hash of the entry's key, set
+ * to that of the entry left over.
+ *
+ * @return the number of displacements made, or -1 if the stash is
+ * full too and the table must grow.
+ */
+static int cuckoo_place(htable h, struct bucket *entry, uint32_t *alt){
+    struct bucket temp;
+    uint32_t temp_alt;
+    unsigned int b = cuckoo_bucket(h, entry->hash);
+    unsigned int first;
+    int kicks = 0;
+    int slot;
+
+    if (cuckoo_free_slot(h, b) < 0){
+        b = cuckoo_bucket(h, *alt);
+    }
+    while ((slot = cuckoo_free_slot(h, b)) < 0 && kicks < CUCKOO_KICKS){
+        slot = b + (entry->hash + kicks) % CUCKOO_WAYS;
+        temp = *SLOT(h, slot);
+        temp_alt = *CUCKOO_ALT(h, slot);
+        cuckoo_set(h, slot, entry, *alt);
+        *entry = temp;
+        *alt = temp_alt;
+        kicks++;
+        /* the displaced entry goes to its bucket it was not in */
+        first = cuckoo_bucket(h, entry->hash);
+        b = (first == b) ? cuckoo_bucket(h, *alt) : first;
+    }
+    if (slot < 0 && h->stashed < CUCKOO_STASH){
+        slot = h->capacity - CUCKOO_STASH + h->stashed++;
+    }
+    if (slot < 0){
+        return -1;
+    }
+    cuckoo_set(h, slot, entry, *alt);
+    return kicks;
+}
+
+/**
+ * Rounds a capacity to what a CUCKOO table needs: a whole number of
+ * buckets, at least one, followed by the stash.
+ *
+ * @param capacity the capacity asked for.
+ *
+ * @return the capacity to use.
+ */
+static int cuckoo_capacity(int capacity){
+    int buckets = (capacity - CUCKOO_STASH + CUCKOO_WAYS - 1) / CUCKOO_WAYS;
+    if (buckets < 1){
+        buckets = 1;
+    }
+    return buckets * CUCKOO_WAYS + CUCKOO_STASH;
+}
+
+/**
+ * checks if the given number is a prime number
+ *
+ * @param number the number to check.
+ *
+ * @return 1 if number is a prime, 0 if not.
+ */
+static int is_prime(int number){
+    int i;
+    if (number <= 3){
+        return number > 1;
+    }else if (number % 2 == 0 || number % 3 == 0){
+        return 0;
+    }
+    for (i = 5; i * i <= number; i += 6){
+        if (number % i == 0 || number % (i + 2) == 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Finds the first prime at least as large as the given number, by
+ * trial division.
+ *
+ * @param number the number to start from.
+ *
+ * @return the prime.
+ */
+static int next_prime(int number){
+    while (!is_prime(number)){
+        number++;
+    }
+    return number;
+}
+
+/**
+ * Places a key that is known not to be in the table yet, without
+ * copying it. Used when moving keys into a resized table.
+ *
+ * @param h the table to place the key in.
+ * @param old the bucket holding the key, its hash and frequency.
+ *
+ * @return the number of collisions it took to find a free slot, or -1
+ * if a CUCKOO table has no room for it.
+ */
+static int htable_place(htable h, struct bucket *old){
+    unsigned int i = htable_home(h, old->hash);
+    unsigned int step = htable_wrap(h, htable_step(h, old->hash));
+    int collisions = 0;
+    struct bucket entry;
+    uint32_t alt;
+    if (IS_ROBIN(h)){
+        return robin_hood_place(h, *old, i, 0);
+    }else if (IS_CUCKOO(h)){
+        entry = *old;
+        alt = (uint32_t) (htable_word_to_wide(h, bucket_key(h, old)) >> 32);
+        return cuckoo_place(h, &entry, &alt);
+    }else if (IS_SWISS(h)){
+        i = swiss_find(h, bucket_key(h, old), old->hash, &collisions);
+        h->buckets[i] = *old;
+        swiss_set_ctrl(h, i, CTRL_H2(old->hash));
+        return collisions;
+    }
+    while (h->buckets[i].key != NO_KEY){
+        i = htable_wrap(h, i + step);
+        collisions++;
+    }
+    h->buckets[i] = *old;
+    return collisions;
+}
+
+/**
+ * Allocates the buckets of a table, all empty, with the first one
+ * starting a cache line.
+ *
+ * @param h the table to allocate buckets for.
+ */
+static void buckets_new(htable h){
+    int i;
+    h->buckets_mem = emalloc(buckets_size(IS_CUCKOO(h), h->capacity)
+                             + CACHE_LINE);
+    h->buckets = (struct bucket *) (((uintptr_t) h->buckets_mem
+                                     + CACHE_LINE - 1)
+                                    & ~(uintptr_t) (CACHE_LINE - 1));
+    for (i = 0; i < h->capacity; i++){
+        SLOT(h, i)->hash = 0;
+        SLOT(h, i)->freq = 0;
+        SLOT(h, i)->key = NO_KEY;
+    }
+}
+
+/**
+ * Allocates the collision stats of a table, one for each slot, all 0,
+ * in place of its old ones.
+ *
+ * @param h the table to allocate stats for.
+ */
+static void stats_new(htable h){
+    int i;
+    if (!h->in_image){
+        free(h->stats);
+    }
+    h->stats = emalloc(h->capacity * sizeof h->stats[0]);
+    for (i = 0; i < h->capacity; i++){
+        h->stats[i] = 0;
+    }
+}
+
+/**
+ * Finds the capacity a table grows to: the first prime at least twice
+ * its current size, or just twice its size if that is a power of two.
+ * A CUCKOO table is only rounded to whole buckets.
+ *
+ * @param h the table to grow.
+ *
+ * @return the new capacity.
+ */
+static int grown_capacity(htable h){
+    if (IS_CUCKOO(h)){
+        return cuckoo_capacity(2 * h->capacity + 1);
+    }else if (h->pow2){
+        return 2 * h->capacity;
+    }
+    return next_prime(2 * h->capacity + 1);
+}
+
+/**
+ * Grows the table to the first prime at least twice its current size
+ * and rehashes every key into it. Frequencies are carried across and
+ * the collision stats are recorded again for the new layout. A table
+ * whose capacity is a power of two just doubles. A CUCKOO table is
+ * only rounded to whole buckets, and grows again if its keys do not
+ * all fit.
+ *
+ * @param h the table to grow.
+ */
+static void htable_grow(htable h){
+    struct bucket *old = h->buckets;
+    struct bucket *b;
+    void *old_mem = h->buckets_mem;
+    int old_capacity = h->capacity;
+    int i, n, placed;
+
+    do{
+        h->capacity = grown_capacity(h);
+        buckets_new(h);
+        stats_new(h);
+        h->in_image = 0;
+        if (IS_SWISS(h)){
+            free(h->ctrl);
+            swiss_new_ctrl(h);
+        }
+        h->stashed = 0;
+        n = 0;
+        placed = 0;
+        for (i = 0; i < old_capacity && placed >= 0; i++){
+            b = slot_in(old, IS_CUCKOO(h), i);
+            if (b->key != NO_KEY){
+                placed = htable_place(h, b);
+                h->stats[n++] = placed;
+            }
+        }
+        if (placed < 0){
+            free(h->buckets_mem);
+        }
+    }while (placed < 0);
+    free(old_mem);
+}
+
+/**
+ * Sets the load factor at which the table grows and rehashes.
+ * Values outside (0, 1] fall back to the default.
+ *
+ * @param h the table to configure.
+ * @param max_load the largest fraction of slots allowed to be used.
+ */
+void htable_set_max_load(htable h, double max_load){
+    if (max_load <= 0.0 || max_load > 1.0){
+        max_load = DEFAULT_LOAD;
+    }
+    h->max_load = max_load;
+}
+
+/**
+ * Gives the number of different keys in the table. A shared table
+ * only has them all once htable_end_shared has put it together.
+ *
+ * @param h the table to count the keys of.
+ *
+ * @return the number of different keys.
+ */
+int htable_num_keys(htable h){
+    return h->num_keys;
+}
+
+/**
+ * Builds a new table with an initial size of capacity,
+ * a hashing style of method and a hash function of hash.
+ * The table grows by itself once it passes its maximum load factor.
+ *
+ * @param capacity the initial size of the hash table, rounded up to a
+ * prime, or to whole buckets for a CUCKOO table.
+ * @param method the hashing method to use.
+ * @param hash the hash function to turn keys into integers with.
+ *
+ * @return result the new hash table.
+ */
+htable htable_new(int capacity, hashing_t method, hashfn_t hash) {
+    htable result = emalloc(sizeof *result);
+    if(capacity<1){
+        result->capacity = 113;
+    }else{
+        result->capacity = capacity;
+    }
+    result->asked = result->capacity;
+    result->method = method;
+    if(method == CUCKOO){
+        result->capacity = cuckoo_capacity(result->capacity);
+    }else{
+        result->capacity = next_prime(result->capacity);
+    }
+    buckets_new(result);
+    result->num_keys = 0;
+    result->text = NULL;
+    result->text_size = 0;
+    result->text_cap = 0;
+    result->loaded = 0;
+    result->stats = NULL;
+    result->in_image = 0;
+    stats_new(result);
+    result->hash = hash;
+    result->max_load = DEFAULT_LOAD;
+    result->ctrl = NULL;
+    result->shared = 0;
+    result->next = NULL;
+    result->image = NULL;
+    result->image_size = 0;
+    result->image_mapped = 0;
+    result->stashed = 0;
+    result->pow2 = 0;
+    if (IS_SWISS(result)){
+        swiss_new_ctrl(result);
+    }
+    return result;
+}
+
+/**
+ * frees the memory space of the hash table, and of every level after
+ * it if it is shared.
+ *
+ * @param h the word to table to free.
+ */
+void htable_free(htable h){
+    htable next;
+    while (h->next != NULL){
+        next = h->next;
+        h->next = next->next;
+        next->next = NULL;
+        htable_free(next);
+    }
+    if (h->text_cap != 0){
+        free(h->text);
+    }
+    if (!h->in_image){
+        free(h->stats);
+    }
+    free(h->buckets_mem);
+    free(h->ctrl);
+    if (h->image_mapped){
+        unmap_stream(h->image, h->image_size);
+    }else{
+        free(h->image);
+    }
+    free(h);
+}
+
+/**
+ * Makes the table's capacity a power of two, the next one up from
+ * what htable_new was asked for, so that slots are found by
+ * multiplying and masking instead of dividing by a prime. A CUCKOO
+ * table keeps its capacity but finds its buckets the same way. Must be
+ * called before any keys are inserted, and before htable_set_shared.
+ *
+ * @param h the table to change.
+ *
+ * @return 1 if the table now uses powers of two, 0 if it cannot.
+ */
+int htable_set_pow2(htable h){
+    int capacity = 1;
+    if (h->num_keys != 0 || h->shared || h->asked > (1 << 30)){
+        return 0;
+    }
+    h->pow2 = 1;
+    if (IS_CUCKOO(h)){
+        return 1;
+    }
+    while (capacity < h->asked){
+        capacity *= 2;
+    }
+    h->capacity = capacity;
+    free(h->buckets_mem);
+    buckets_new(h);
+    stats_new(h);
+    h->in_image = 0;
+    if (IS_SWISS(h)){
+        free(h->ctrl);
+        swiss_new_ctrl(h);
+    }
+    return 1;
+}
+
+/**
+ * Lets any number of threads insert into and search the table at the
+ * same time. Must be called before any keys are inserted, and only on
+ * LINEAR_P or DOUBLE_H tables. The buckets and text of a shared table
+ * cannot move, so it grows by passing keys on to a level twice its
+ * size once it is past its maximum load or its text, of SHARED_TEXT
+ * bytes a slot, is full. htable_end_shared must be called once the
+ * threads are done, before the table is used in any other way than
+ * htable_insert and htable_search.
+ *
+ * @param h the table to share.
+ *
+ * @return 1 if the table is now shared, 0 if it cannot be.
+ */
+int htable_set_shared(htable h){
+    size_t cap = (size_t) h->capacity * SHARED_TEXT;
+    if (h->num_keys != 0 || !(IS_LINEAR(h) || IS_DOUBLE(h))){
+        return 0;
+    }
+    if (cap > SEALED){
+        cap = SEALED;
+    }
+    if (h->text_cap != 0){
+        free(h->text);
+    }
+    h->text = emalloc(cap);
+    h->text_cap = cap;
+    h->text_size = 0;
+    h->loaded = 0;
+    h->shared = 1;
+    return 1;
+}
+
+/**
+ * Finds the level a shared table passes keys on to, making it if no
+ * thread has yet. Threads that make one at the same time race to link
+ * theirs in with a compare-and-swap, and the losers free theirs.
+ *
+ * @param h the level that is full.
+ *
+ * @return the next level, or NULL if it would be too large.
+ */
+static htable shared_next(htable h){
+    htable next = __atomic_load_n(&h->next, __ATOMIC_ACQUIRE);
+    htable made;
+    if (next != NULL || h->capacity > (1 << 29)){
+        return next;
+    }
+    made = htable_new(grown_capacity(h), h->method, h->hash);
+    if (h->pow2){
+        htable_set_pow2(made);
+    }
+    htable_set_max_load(made, h->max_load);
+    htable_set_shared(made);
+    if (__atomic_compare_exchange_n(&h->next, &next, made, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        return made;
+    }
+    htable_free(made);
+    return next;
+}
+
+/**
+ * Copies a key onto the end of a shared table's text, taking room for
+ * it with a compare-and-swap so that threads never copy over each
+ * other. The text never moves, so keys can be read while others are
+ * being copied.
+ *
+ * @param h the shared table to add the key to.
+ * @param str the key.
+ *
+ * @return the offset of the copy, or NO_KEY if the text is full.
+ */
+static uint32_t shared_text_add(htable h, const char *str){
+    size_t len = strlen(str) + 1;
+    size_t start = __atomic_load_n(&h->text_size, __ATOMIC_RELAXED);
+    do{
+        if (len > h->text_cap - start){
+            return NO_KEY;
+        }
+    }while (!__atomic_compare_exchange_n(&h->text_size, &start, start + len,
+                                         1, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED));
+    memcpy(h->text + start, str, len);
+    return (uint32_t) start;
+}
 
 /**
- * Converts a given character pointer into an integer
+ * Gives back the room taken for a copy of a key that was not used,
+ * which can only be done while no other copy has been made after it.
  *
- * @param word the word to convert.
- * @return result the integer representation of the word.
+ * @param h the shared table the copy is in.
+ * @param copy the offset of the copy, or NO_KEY if there is none.
  */
-static unsigned int htable_word_to_int(char *word){
-    unsigned int result = 0;
-    while (*word != '\0'){
-        result = (*word++ + 31*result);
+static void shared_text_undo(htable h, uint32_t copy){
+    size_t end;
+    if (copy != NO_KEY){
+        end = copy + strlen(h->text + copy) + 1;
+        __atomic_compare_exchange_n(&h->text_size, &end, (size_t) copy, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
     }
-    return result;
 }
 
+/**
+ * Inserts a key into one level of a shared table without taking any
+ * locks. A slot is claimed by a compare-and-swap of its key from
+ * NO_KEY to the offset of a copy of str, its hash is published
+ * afterwards, and frequencies are bumped with atomic adds. Once the
+ * level is full, the empty slot str would have gone in is sealed
+ * instead, so that any thread after the same key moves on to the next
+ * level too. A thread that loses the race for a slot checks whether
+ * the winner inserted the same key before moving on, and gives back
+ * its copy if it ends up not using it.
+ *
+ * @param h the level to add to.
+ * @param str the key to add into the table.
+ * @param result the hash of str.
+ * @param count how much to add to the key's frequency.
+ *
+ * @return 1 if the key was new, its new frequency if not, or 0 if
+ * it belongs in the next level.
+ */
+static int shared_level_insert(htable h, char *str, unsigned int result,
+                               int count){
+    unsigned int i = htable_home(h, result);
+    unsigned int step = htable_wrap(h, htable_step(h, result));
+    unsigned int hash;
+    int collisions = 0;
+    int full;
+    uint32_t copy = NO_KEY;
+    uint32_t key;
+    struct bucket *b;
 
+    while (collisions != h->capacity){
+        b = &h->buckets[i];
+        key = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+        if (key == NO_KEY){
+            full = __atomic_load_n(&h->num_keys, __ATOMIC_RELAXED) + 1
+                > h->capacity * h->max_load;
+            if (!full && copy == NO_KEY){
+                copy = shared_text_add(h, str);
+                full = (copy == NO_KEY);
+            }
+            if (__atomic_compare_exchange_n(&b->key, &key,
+                                            full ? SEALED : copy, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)){
+                if (full){
+                    shared_text_undo(h, copy);
+                    return 0;
+                }
+                __atomic_store_n(&b->hash, result, __ATOMIC_RELEASE);
+                h->stats[__atomic_fetch_add(&h->num_keys, 1,
+                                            __ATOMIC_RELAXED)] = collisions;
+                __atomic_add_fetch(&b->freq, count, __ATOMIC_RELEASE);
+                return 1;
+            }
+            /* lost the race, key is now the winner's key */
+        }
+        if (key == SEALED){
+            shared_text_undo(h, copy);
+            return 0;
+        }
+        /* a hash of 0 may just not have been published yet */
+        hash = __atomic_load_n(&b->hash, __ATOMIC_ACQUIRE);
+        if ((hash == result || hash == 0) && strcmp(h->text + key, str) == 0){
+            shared_text_undo(h, copy);
+            return __atomic_add_fetch(&b->freq, count, __ATOMIC_ACQ_REL);
+        }
+        i = htable_wrap(h, i + step);
+        collisions++;
+    }
+    shared_text_undo(h, copy);
+    return 0;
+}
 
 /**
- * Calculates the step size for the given key
+ * Inserts a key into a shared table, level by level, until a level
+ * takes it.
  *
- * @param h the table being used.
- * @param i_key the integer representation of a word.
+ * @param h the shared table to add to.
+ * @param str the key to add into the table.
+ * @param result the hash of str.
+ * @param count how much to add to the key's frequency.
  *
- * @return the step,1 if linear and claculated if double.
+ * @return 1 if the key was new, its new frequency if not, or 0 if
+ * the table cannot grow any larger.
  */
-static unsigned int htable_step(htable h, unsigned int i_key){
-    if (IS_DOUBLE(h)){
-        return 1 + (i_key % (h->capacity - 1));
-    }else{
-        return 1;
+static int shared_insert(htable h, char *str, unsigned int result, int count){
+    int done;
+    while ((done = shared_level_insert(h, str, result, count)) == 0){
+        h = shared_next(h);
+        if (h == NULL){
+            return 0;
+        }
     }
+    return done;
 }
 
 /**
- * Builds a new table with a maximum size of capacity,
- * and a hashing style of method
+ * Searches a shared table while other threads may be inserting. The
+ * search is wait-free, it never looks at more than capacity slots of
+ * any level. It stops at the first slot that has not been claimed,
+ * and moves on to the next level at a sealed slot or once it has been
+ * round the whole level.
  *
- * @param capacity the maximum size of the hash table.
- * @param method the hashing method to use, linear or double.
+ * @param h the shared table to search.
+ * @param str the key to search for.
+ * @param result the hash of str.
  *
- * @return result the new hash table.
+ * @return frequency of key if found, otherwise 0.
  */
-htable htable_new(int capacity, hashing_t method) {
-    int i;
-    htable result = emalloc(sizeof *result);
-    if(capacity<1){
-        result->capacity = 113;
-    }else{
-        result->capacity = capacity;
+static int shared_search(htable h, char *str, unsigned int result){
+    unsigned int i, step, hash;
+    int collisions;
+    uint32_t key;
+
+    while (h != NULL){
+        i = htable_home(h, result);
+        step = htable_wrap(h, htable_step(h, result));
+        for (collisions = 0; collisions != h->capacity; collisions++){
+            key = __atomic_load_n(&h->buckets[i].key, __ATOMIC_ACQUIRE);
+            if (key == NO_KEY){
+                return 0;
+            }else if (key == SEALED){
+                break;
+            }
+            hash = __atomic_load_n(&h->buckets[i].hash, __ATOMIC_ACQUIRE);
+            if ((hash == result || hash == 0)
+                && strcmp(h->text + key, str) == 0){
+                return __atomic_load_n(&h->buckets[i].freq,
+                                       __ATOMIC_ACQUIRE);
+            }
+            i = htable_wrap(h, i + step);
+        }
+        h = __atomic_load_n(&h->next, __ATOMIC_ACQUIRE);
     }
-    result->keys = emalloc(result->capacity * sizeof (result->keys));
-    result->num_keys = 0;
-    result->freq = emalloc(result->capacity * sizeof (result->freq));
-    result->stats = emalloc(result->capacity * sizeof(result->stats));
-    for(i =0;i<result->capacity;i++){        
-        result->freq[i] = 0;
-        result->stats[i] = 0;
-        result->keys[i] = NULL;
+    return 0;
+}
+
+/**
+ * Checks whether a table has to grow before it takes another key. A
+ * SWISS table always keeps an empty slot to end its probes.
+ *
+ * @param h the table to check.
+ *
+ * @return 1 if another key would take it past its maximum load.
+ */
+static int htable_full(htable h){
+    return h->num_keys + 1 > h->capacity * h->max_load
+        || (IS_SWISS(h) && h->num_keys + 1 >= h->capacity);
+}
+
+/**
+ * Inserts a key using Robin Hood hashing. The search for an existing
+ * copy of the key stops as soon as it reaches a resident that is
+ * closer to its home than the key would be. A new key grows the table
+ * first if it has to.
+ *
+ * @param h the table to add to.
+ * @param str the key to add into the table.
+ * @param result the hash of str.
+ * @param count how much to add to the key's frequency.
+ *
+ * @return 1 if the key was new, its new frequency if not, or 0 if
+ * the text is full.
+ */
+static int robin_hood_insert(htable h, char *str, unsigned int result,
+                             int count){
+    unsigned int i = htable_home(h, result);
+    int dist = 0;
+    struct bucket *b;
+    struct bucket entry;
+
+    for (;;){
+        b = &h->buckets[i];
+        if (b->key == NO_KEY || htable_distance(h, i) < dist){
+            break;
+        }
+        if (b->hash == result && strcmp(bucket_key(h, b), str) == 0){
+            b->freq += count;
+            return b->freq;
+        }
+        i = htable_wrap(h, i + 1);
+        dist++;
     }
-    result->method = method;
-    return result;
+    if (htable_full(h)){
+        htable_grow(h);
+        return robin_hood_insert(h, str, result, count);
+    }
+    entry.hash = result;
+    entry.freq = count;
+    entry.key = text_add(h, str);
+    if (entry.key == NO_KEY){
+        return 0;
+    }
+    h->stats[h->num_keys] = robin_hood_place(h, entry, i, dist);
+    h->num_keys++;
+    return 1;
 }
 
 /**
- * frees the memory space of the hash table.
+ * Inserts a key into a SWISS table. A new key grows the table first if
+ * it has to.
  *
- * @param h the word to table to free.
+ * @param h the table to add to.
+ * @param str the key to add into the table.
+ * @param result the hash of str.
+ * @param count how much to add to the key's frequency.
+ *
+ * @return 1 if the key was new, its new frequency if not, or 0 if
+ * the table or the text is full.
  */
-void htable_free(htable h){
-    int i;
-    for(i=0;i<h->capacity;i++){
-        free(h->keys[i]);
+static int swiss_insert(htable h, char *str, unsigned int result, int count){
+    int groups;
+    unsigned int i = swiss_find(h, str, result, &groups);
+    struct bucket *b;
+
+    if (i == (unsigned int) h->capacity){
+        return 0;
+    }
+    b = &h->buckets[i];
+    if (b->key != NO_KEY){
+        b->freq += count;
+        return b->freq;
     }
-    free(h->keys);
+    if (htable_full(h)){
+        htable_grow(h);
+        return swiss_insert(h, str, result, count);
+    }
+    b->key = text_add(h, str);
+    if (b->key == NO_KEY){
+        return 0;
+    }
+    b->hash = result;
+    b->freq = count;
+    swiss_set_ctrl(h, i, CTRL_H2(result));
+    h->stats[h->num_keys] = groups;
+    h->num_keys++;
+    return 1;
+}
 
-    free(h->freq);
-    free(h->stats);
-    free(h);
+/**
+ * Checks whether both buckets of a 64-bit hash are full of keys with
+ * that very hash. Another such key could only go in the stash, and
+ * growing the table would not give it anywhere else to go.
+ *
+ * @param h the table being used.
+ * @param result the low half of the hash.
+ * @param alt the high half of the hash.
+ *
+ * @return 1 if there is no room for another key with the hash.
+ */
+static int cuckoo_crowded(htable h, unsigned int result, unsigned int alt){
+    unsigned int b[2];
+    int i, j;
+    b[0] = cuckoo_bucket(h, result);
+    b[1] = cuckoo_bucket(h, alt);
+    for (i = 0; i < 2; i++){
+        for (j = 0; j < CUCKOO_WAYS; j++){
+            if (SLOT(h, b[i] + j)->key == NO_KEY
+                || SLOT(h, b[i] + j)->hash != result
+                || *CUCKOO_ALT(h, b[i] + j) != alt){
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Inserts a key into a CUCKOO table. A new key grows the table first
+ * if it has to, or if its stash is full, so that there is always room
+ * for the entry a chain of displacements leaves over.
+ *
+ * @param h the table to add to.
+ * @param str the key to add into the table.
+ * @param result the hash of str.
+ * @param alt the high half of the 64-bit hash of str.
+ * @param count how much to add to the key's frequency.
+ *
+ * @return 1 if the key was new, its new frequency if not, or 0 if
+ * too many keys have its 64-bit hash or the text is full.
+ */
+static int cuckoo_insert(htable h, char *str, unsigned int result,
+                         uint32_t alt, int count){
+    struct bucket *b = cuckoo_find(h, str, result, alt);
+    struct bucket entry;
+
+    if (b != NULL){
+        b->freq += count;
+        return b->freq;
+    }
+    if (cuckoo_crowded(h, result, alt)){
+        return 0;
+    }
+    if (htable_full(h)){
+        htable_grow(h);
+    }
+    while (h->stashed == CUCKOO_STASH){
+        htable_grow(h);
+    }
+    entry.hash = result;
+    entry.freq = count;
+    entry.key = text_add(h, str);
+    if (entry.key == NO_KEY){
+        return 0;
+    }
+    h->stats[h->num_keys] = cuckoo_place(h, &entry, &alt);
+    h->num_keys++;
+    return 1;
+}
+
+/**
+ * Attempts to insert a key into the table with a frequency of count,
+ * if the key already exists add count to the frequency.
+ * The table grows only when a new key would take it past its maximum
+ * load, never for a key it already holds.
+ * 
+ * @param h the table to add to.
+ * @param str the key to add into the table.
+ * @param count how much to add to the key's frequency.
+ *
+ * @return 1 if insert was successful, 0 if not.
+ */
+static int htable_insert_count(htable h, char *str, int count){
+    uint64_t wide;
+    unsigned int result;
+    unsigned int i;
+    unsigned int step;
+    int collisions = 0;
+    struct bucket *b;
+
+    if (h->shared){
+        return shared_insert(h, str, htable_word_to_int(h, str), count);
+    }
+    wide = htable_word_to_wide(h, str);
+    result = (unsigned int) wide;
+    if (IS_ROBIN(h)){
+        return robin_hood_insert(h, str, result, count);
+    }else if (IS_CUCKOO(h)){
+        return cuckoo_insert(h, str, result, (uint32_t) (wide >> 32), count);
+    }else if (IS_SWISS(h)){
+        return swiss_insert(h, str, result, count);
+    }
+    i = htable_home(h, result);
+    step = htable_wrap(h, htable_step(h, result));
+    
+    while(collisions != h->capacity){
+        b = &h->buckets[i];
+        if(b->key == NO_KEY){
+            if(htable_full(h)){
+                htable_grow(h);
+                return htable_insert_count(h, str, count);
+            }
+            b->key = text_add(h, str);
+            if(b->key == NO_KEY){
+                return 0;
+            }
+            b->hash = result;
+            b->freq = count;
+            h->stats[h->num_keys] = collisions;
+            h->num_keys++;
+            return 1;
+        }else if(b->hash == result && strcmp(bucket_key(h, b),str) == 0){
+            b->freq += count;
+            return b->freq;
+        }
+        i = htable_wrap(h, i + step);
+        collisions++;
+    }
+    /* every slot is taken, which only a load of 1 allows */
+    if(htable_full(h)){
+        htable_grow(h);
+        return htable_insert_count(h, str, count);
+    }
+    return 0;
 }
 
 /**
  * Attempts to insert a key into the table,
  * if the key already exists increment the frequency.
  * 
- * 
  * @param h the table to add to.
  * @param str the key to add into the table.
  *
  * @return 1 if insert was successful, 0 if not.
  */
 int htable_insert(htable h, char *str){
-    unsigned int result = htable_word_to_int(str);
-    unsigned int hashIndex = result % h->capacity;
-    unsigned int step = (htable_step(h,result) % h->capacity);
-    
-    if (h->freq[hashIndex] == 0){
-        h->keys[hashIndex] = erealloc(h->keys[hashIndex], (strlen(str)+1) *
-                                      sizeof h->keys[0][0]);
-        strcpy(h->keys[hashIndex],str);
-        h->freq[hashIndex]++;
-        h->num_keys++;
-        return 1;
-    }else if(strcmp(str,h->keys[hashIndex]) == 0){
-        h->freq[hashIndex]++;
-        return h->freq[hashIndex];
-    }else if(strcmp(str,h->keys[hashIndex]) != 0){
-        unsigned int newIndex = hashIndex;
-        int numKeys = h->num_keys;
-        int i = 0;
-        unsigned int colisions =0;
-        while(i != h->capacity){
-            if(h->freq[newIndex] == 0){
-                h->keys[newIndex] = erealloc(h->keys[newIndex],(strlen(str)+1)
-                                             * sizeof h->keys[0][0]);
-                strcpy(h->keys[newIndex],str);
-                h->freq[newIndex]++;
-                h->stats[numKeys] = colisions;
-                h->num_keys++;
-                return 1;
-            }else if(strcmp(h->keys[newIndex],str) == 0){
-                h->freq[newIndex]++;
-                return h->freq[newIndex];
+    return htable_insert_count(h, str, 1);
+}
+
+/**
+ * Adds every key of src to dst, adding their frequencies together for
+ * keys that are in both. The keys of src are visited in the order src
+ * first saw them, which is the order its text holds them in, so
+ * merging tables built from consecutive pieces of the input lays dst
+ * out exactly as a table built from the whole input.
+ *
+ * @param dst the table to merge into.
+ * @param src the table to merge from, left unchanged, which must not
+ * be shared. Only the keys inserted into it are visited, not those
+ * loaded by htable_load.
+ */
+void htable_merge(htable dst, htable src){
+    size_t i = src->loaded;
+    char *key;
+    while (i < src->text_size){
+        key = src->text + i;
+        htable_insert_count(dst, key, htable_search(src, key));
+        i += strlen(key) + 1;
+    }
+}
+
+/**
+ * Ends shared use of a table once no other thread is using it. The
+ * keys of every level are moved into one table as large as the last
+ * level, or larger if they need it, that grows as usual.
+ *
+ * @param h the shared table.
+ */
+void htable_end_shared(htable h){
+    struct htablerec temp;
+    htable flat, level;
+    int i, total = 0, capacity = 0;
+
+    if (!h->shared){
+        return;
+    }
+    for (level = h; level != NULL; level = level->next){
+        total += level->num_keys;
+        capacity = level->capacity;
+    }
+    if (total / h->max_load + 1 > capacity){
+        capacity = (int) (total / h->max_load) + 1;
+    }
+    flat = htable_new(capacity, h->method, h->hash);
+    if (h->pow2){
+        htable_set_pow2(flat);
+    }
+    htable_set_max_load(flat, h->max_load);
+    for (level = h; level != NULL; level = level->next){
+        for (i = 0; i < level->capacity; i++){
+            if (level->buckets[i].key != NO_KEY
+                && level->buckets[i].key != SEALED){
+                htable_insert_count(flat,
+                                    bucket_key(level, &level->buckets[i]),
+                                    level->buckets[i].freq);
             }
-            newIndex = ((newIndex + step)%h->capacity);
-            colisions += 1;
-            i++;
         }
     }
-    return 0;
+    temp = *h;
+    *h = *flat;
+    *flat = temp;
+    htable_free(flat);
 }
 
 
@@ -168,34 +1729,114 @@ int htable_insert(htable h, char *str){
 void htable_print(htable h, void f(int x,char *str)){
     int i;
     for(i=0;i<h->capacity;i++){
-        if(h->freq[i]>0){
-            f(h->freq[i],h->keys[i]);
+        if(SLOT(h, i)->key != NO_KEY){
+            f(SLOT(h, i)->freq,bucket_key(h, SLOT(h, i)));
         }
     }
 }
 
 /**
- * Converts a given character pointer into an integer.
+ * Searches for a key whose hash has already been worked out.
  *
  * @param h the table to search.
  * @param str the key to search for.
+ * @param wide the 64-bit hash of str, the low half of which is its
+ * hash.
  *
  * @return frequency of key if found, otherwise 0.
  */
-int htable_search(htable h, char *str){
+static int search_hashed(htable h, char *str, uint64_t wide){
+    unsigned int result = (unsigned int) wide;
     int collisions = 0;
-    unsigned int result = htable_word_to_int(str);
-    unsigned int i = result % h->capacity;
+    unsigned int i = htable_home(h, result);
     unsigned int step = htable_step(h,result);
     int cap = h->capacity;
-    while(h->freq[i] != 0 && strcmp(str,h->keys[i]) != 0 && collisions < cap){
-        i = ((i + step)%h->capacity);
+    struct bucket *b;
+    if (h->shared){
+        return shared_search(h, str, result);
+    }else if (IS_CUCKOO(h)){
+        b = cuckoo_find(h, str, result, (unsigned int) (wide >> 32));
+        return (b == NULL) ? 0 : b->freq;
+    }else if (IS_SWISS(h)){
+        i = swiss_find(h, str, result, NULL);
+        return (i == (unsigned int) h->capacity) ? 0 : h->buckets[i].freq;
+    }else if (IS_ROBIN(h)){
+        /* a resident closer to home than we are means str is absent */
+        while(h->buckets[i].key != NO_KEY && htable_distance(h, i) >= collisions){
+            if(h->buckets[i].hash == result &&
+               strcmp(str,bucket_key(h, &h->buckets[i])) == 0){
+                return h->buckets[i].freq;
+            }
+            i = htable_wrap(h, i + 1);
+            collisions++;
+        }
+        return 0;
+    }
+    while(h->buckets[i].key != NO_KEY && collisions < cap &&
+          (h->buckets[i].hash != result ||
+           strcmp(str,bucket_key(h, &h->buckets[i])) != 0)){
+        i = htable_wrap(h, i + step);
         collisions++;
     }
     if(collisions == cap){
         return 0;
     }else {
-        return h->freq[i];
+        return h->buckets[i].freq;
+    }
+}
+
+/**
+ * Converts a given character pointer into an integer.
+ *
+ * @param h the table to search.
+ * @param str the key to search for.
+ *
+ * @return frequency of key if found, otherwise 0.
+ */
+int htable_search(htable h, char *str){
+    return search_hashed(h, str, htable_word_to_wide(h, str));
+}
+
+/**
+ * Searches for several keys at once. The keys are taken SEARCH_BATCH
+ * at a time: all of them are hashed and their home slots prefetched,
+ * then the keys in those slots are prefetched, and only then is each
+ * one searched for, so the cache misses of a group overlap instead of
+ * being waited for one after another.
+ *
+ * @param h the table to search.
+ * @param words the keys to search for.
+ * @param n the number of keys.
+ * @param results set to the frequency of each key, 0 if not found.
+ */
+void htable_search_batch(htable h, char **words, int n, int *results){
+    uint64_t hashes[SEARCH_BATCH];
+    unsigned int homes[SEARCH_BATCH];
+    int i, j, m;
+    for (i = 0; i < n; i += m){
+        m = (n - i < SEARCH_BATCH) ? n - i : SEARCH_BATCH;
+        for (j = 0; j < m; j++){
+            hashes[j] = htable_word_to_wide(h, words[i + j]);
+            homes[j] = htable_home(h, (unsigned int) hashes[j]);
+            if (IS_SWISS(h)){
+                PREFETCH(h->ctrl + homes[j]);
+            }else if (IS_CUCKOO(h)){
+                homes[j] = cuckoo_bucket(h, (unsigned int) hashes[j]);
+                PREFETCH(SLOT(h, cuckoo_bucket(h, hashes[j] >> 32)));
+            }
+            PREFETCH(SLOT(h, homes[j]));
+        }
+        /* keys of a shared table may be written while we look */
+        if (!h->shared){
+            for (j = 0; j < m; j++){
+                if (SLOT(h, homes[j])->key != NO_KEY){
+                    PREFETCH(bucket_key(h, SLOT(h, homes[j])));
+                }
+            }
+        }
+        for (j = 0; j < m; j++){
+            results[i + j] = search_hashed(h, words[i + j], hashes[j]);
+        }
     }
 }
 
@@ -211,10 +1852,11 @@ void htable_print_entire_table(htable h){
     printf("%5s %5s %5s   %s\n","LL","Stats","Freq","Word");
     printf("----------------------------\n");
     while (i<h->capacity){
-        if(h->freq[i] == 0){
-            printf("%5d %5d %5d   %s\n",i,h->stats[i],h->freq[i]," ");
+        if(SLOT(h, i)->key == NO_KEY){
+            printf("%5d %5d %5d   %s\n",i,h->stats[i],SLOT(h, i)->freq," ");
         }else{
-            printf("%5d %5d %5d   %s\n",i,h->stats[i],h->freq[i],h->keys[i]);
+            printf("%5d %5d %5d   %s\n",i,h->stats[i],SLOT(h, i)->freq,
+                   bucket_key(h, SLOT(h, i)));
         }
         i++;
     }
@@ -255,6 +1897,80 @@ static void print_stats_line(htable h, FILE *stream, int percent_full) {
     }
 }
 
+/**
+ * Prints how many keys in the table would share a home slot with an
+ * earlier key at the current capacity under each built in hash
+ * function.
+ *
+ * @param h the hashtable whose keys to hash.
+ * @param stream the stream to send output to.
+ */
+static void print_hash_comparison(htable h, FILE *stream){
+    int *homes = emalloc(h->capacity * sizeof homes[0]);
+    int f, i, shared;
+
+    fprintf(stream, "Hash       Shared Homes\n");
+    fprintf(stream, "-----------------------\n");
+    for (f = 0; f < NUM_HASHES; f++){
+        shared = 0;
+        for (i = 0; i < h->capacity; i++){
+            homes[i] = 0;
+        }
+        for (i = 0; i < h->capacity; i++){
+            if (SLOT(h, i)->key != NO_KEY){
+                char *key = bucket_key(h, SLOT(h, i));
+                unsigned int home = htable_home(h, (unsigned int)
+                    hash_functions[f].fn(key, strlen(key)));
+                if (homes[home]++ > 0){
+                    shared++;
+                }
+            }
+        }
+        fprintf(stream, "%c%-9s %12d\n", f == (int) h->hash ? '*' : ' ',
+                hash_functions[f].name, shared);
+    }
+    fprintf(stream, "-----------------------\n\n");
+    free(homes);
+}
+
+/**
+ * Prints how long each built in hash function takes per key on the
+ * keys in the table, with the table's own hash function starred. The
+ * times change from run to run, so they are kept apart from
+ * htable_print_stats.
+ *
+ * @param h the hashtable whose keys to hash.
+ * @param stream the stream to send output to.
+ */
+void htable_print_hash_times(htable h, FILE *stream){
+    volatile unsigned int sink = 0;
+    int f, i, rounds;
+    clock_t start;
+    double seconds;
+
+    fprintf(stream, "Hash           ns/key\n");
+    fprintf(stream, "---------------------\n");
+    for (f = 0; f < NUM_HASHES; f++){
+        /* repeat the hashing until it takes long enough to time */
+        rounds = 0;
+        start = clock();
+        do{
+            for (i = 0; i < h->capacity; i++){
+                if (SLOT(h, i)->key != NO_KEY){
+                    char *key = bucket_key(h, SLOT(h, i));
+                    sink += hash_functions[f].fn(key, strlen(key));
+                }
+            }
+            rounds++;
+        }while (clock() - start < CLOCKS_PER_SEC / 20 && h->num_keys > 0);
+        seconds = (clock() - start) / (double) CLOCKS_PER_SEC;
+        fprintf(stream, "%c%-9s %10.1f\n", f == (int) h->hash ? '*' : ' ',
+                hash_functions[f].name, h->num_keys > 0 ? seconds * 1e9 /
+                ((double) rounds * h->num_keys) : 0.0);
+    }
+    fprintf(stream, "---------------------\n\n");
+}
+
 /**
  * Prints out a table showing what the following attributes were like
  * at regular intervals (as determined by num_stats) while the
@@ -267,14 +1983,20 @@ static void print_stats_line(htable h, FILE *stream, int percent_full) {
  * @li Maximum Collisions - the most collisions that have occurred
  * while placing a key.
  *
+ * It is followed by how many keys share a home slot under each of the
+ * built in hash functions, with the table's own hash function starred.
+ *
  * @param h the hashtable to print statistics summary from.
  * @param stream the stream to send output to.
  * @param num_stats the maximum number of statistical snapshots to print.
  */
 void htable_print_stats(htable h, FILE *stream, int num_stats) {
     int i;
-    fprintf(stream, "\n%s\n\n", 
-            IS_LINEAR(h)  ? "Linear Probing" : "Double Hashing"); 
+    fprintf(stream, "\n%s\n\n", IS_LINEAR(h) ? "Linear Probing" :
+            IS_ROBIN(h) ? "Robin Hood Hashing" :
+            IS_SWISS(h) ? "Group Probing (collisions are groups)" :
+            IS_CUCKOO(h) ? "Cuckoo Hashing (collisions are displacements)" :
+            "Double Hashing"); 
     fprintf(stream, "Percent   Current   Percent    Average      Maximum\n");
     fprintf(stream, " Full     Entries   At Home   Collisions   Collisions\n");
     fprintf(stream, "-----------------------------------------------------\n");
@@ -282,5 +2004,202 @@ void htable_print_stats(htable h, FILE *stream, int num_stats) {
         print_stats_line(h, stream, 100 * i / num_stats);
     }
     fprintf(stream, "-----------------------------------------------------\n\n");
+    print_hash_comparison(h, stream);
+}
+
+
+/**
+ * Saves the table to a stream as an image that htable_load can use
+ * without rebuilding it: a header, then the buckets, the stats, the
+ * control bytes and the text just as they are in memory, since the
+ * buckets only refer to keys by where they are in the text. The image
+ * is only meant to be loaded on the same kind of machine it was saved
+ * on.
+ *
+ * @param h the table to save.
+ * @param out the stream to save it to, opened for binary writing.
+ *
+ * @return 1 if the table was saved, 0 if it could not be.
+ */
+int htable_save(htable h, FILE *out){
+    struct image_header head;
+
+    memset(&head, 0, sizeof head);
+    memcpy(head.magic, IMAGE_MAGIC, sizeof head.magic);
+    head.byte_order = IMAGE_ORDER;
+    head.capacity = h->capacity;
+    head.num_keys = h->num_keys;
+    head.method = h->method;
+    head.hash = h->hash;
+    head.group_width = (h->ctrl != NULL) ? GROUP_WIDTH : 0;
+    head.pow2 = h->pow2;
+    head.max_load = h->max_load;
+    head.keys_size = h->text_size;
+    fwrite(&head, sizeof head, 1, out);
+    fwrite(h->buckets, 1, buckets_size(IS_CUCKOO(h), h->capacity), out);
+    fwrite(h->stats, sizeof h->stats[0], h->capacity, out);
+    if (h->ctrl != NULL){
+        fwrite(h->ctrl, 1, h->capacity + GROUP_WIDTH - 1, out);
+    }
+    if (h->text_size > 0){
+        fwrite(h->text, 1, h->text_size, out);
+    }
+    return fflush(out) == 0 && !ferror(out);
+}
+
+/**
+ * Checks that some memory holds a whole table image saved on this
+ * kind of machine, with every key inside it, as many keys in its
+ * buckets as it says it has, a load factor it can grow by and, for a
+ * SWISS table, control bytes that agree with its buckets.
+ *
+ * @param image the image.
+ * @param size the size of the image.
+ * @param head set to the header of the image.
+ *
+ * @return where the text starts in the image, or 0 if it is not a
+ * usable table image.
+ */
+static size_t image_check(const char *image, size_t size,
+                          struct image_header *head){
+    struct bucket *buckets = (struct bucket *) (image + sizeof *head);
+    const struct bucket *b;
+    const unsigned char *ctrl;
+    size_t need;
+    int cuckoo;
+    uint32_t i, used = 0;
+
+    if (size < sizeof *head){
+        return 0;
+    }
+    memcpy(head, image, sizeof *head);
+    if (memcmp(head->magic, IMAGE_MAGIC, sizeof head->magic) != 0
+        || head->byte_order != IMAGE_ORDER || head->capacity < 1
+        || head->capacity > INT32_MAX / (sizeof (struct cuckoo_line)
+                                         / CUCKOO_WAYS)
+        || head->method > CUCKOO || head->hash >= (uint32_t) NUM_HASHES
+        || (head->method == SWISS) != (head->group_width != 0)
+        || (head->method == CUCKOO
+            && head->capacity != (uint32_t) cuckoo_capacity(head->capacity))
+        || head->pow2 > 1
+        || (head->pow2 && head->method != CUCKOO
+            && (head->capacity & (head->capacity - 1)) != 0)
+        || head->keys_size >= NO_KEY || head->num_keys > head->capacity
+        || !(head->max_load > 0.0 && head->max_load <= 1.0)){
+        return 0;
+    }
+    cuckoo = (head->method == CUCKOO);
+    need = sizeof *head + buckets_size(cuckoo, head->capacity)
+        + head->capacity * sizeof (int32_t);
+    if (head->group_width != 0){
+        need += head->capacity + head->group_width - 1;
+    }
+    if (size < need || size - need != head->keys_size
+        || (head->keys_size > 0 && image[size - 1] != '\0')){
+        return 0;
+    }
+    ctrl = (const unsigned char *) (image + sizeof *head
+                                    + buckets_size(cuckoo, head->capacity)
+                                    + head->capacity * sizeof (int32_t));
+    for (i = 0; i < head->capacity; i++){
+        b = slot_in(buckets, cuckoo, i);
+        if (b->key != NO_KEY && b->key >= head->keys_size){
+            return 0;
+        }
+        used += (b->key != NO_KEY);
+        if (head->group_width != 0
+            && ctrl[i] != ((b->key == NO_KEY) ? CTRL_EMPTY
+                           : CTRL_H2(b->hash))){
+            return 0;
+        }
+    }
+    /* the control bytes past the end copy those at the start */
+    for (i = head->capacity; head->group_width != 0
+             && i < head->capacity + head->group_width - 1; i++){
+        if (ctrl[i] != ctrl[i % head->capacity]){
+            return 0;
+        }
+    }
+    return (used == head->num_keys) ? need : 0;
 }
 
+/**
+ * Loads a table saved by htable_save. The image is mapped into memory
+ * when the stream is a file, and its buckets, stats and text are used
+ * where they are in it, so loading allocates nothing for each key or
+ * slot. The loaded table can be searched and inserted into like any
+ * other. Its text moves out of the image at the first new key, but new
+ * keys and frequencies go straight into the buckets of the image,
+ * whose mapping is private, until the table first grows.
+ *
+ * @param in the stream to load from, opened for binary reading.
+ *
+ * @return the loaded table, or NULL if the stream does not hold a
+ * table image saved on this kind of machine.
+ */
+htable htable_load(FILE *in){
+    struct image_header head;
+    unsigned char *ctrl;
+    size_t size, keys;
+    char *image = map_stream(in, &size);
+    int mapped = (image != NULL);
+    htable result;
+    int i;
+
+    if (!mapped){
+        image = read_stream(in, &size);
+    }
+    keys = image_check(image, size, &head);
+    if (keys == 0){
+        if (mapped){
+            unmap_stream(image, size);
+        }else{
+            free(image);
+        }
+        return NULL;
+    }
+
+    result = htable_new(1, (hashing_t) head.method, (hashfn_t) head.hash);
+    free(result->buckets_mem);
+    free(result->stats);
+    free(result->ctrl);
+    result->ctrl = NULL;
+    result->capacity = head.capacity;
+    result->asked = head.capacity;
+    result->num_keys = head.num_keys;
+    result->max_load = head.max_load;
+    result->pow2 = head.pow2;
+    result->buckets_mem = NULL;
+    result->buckets = (struct bucket *) (image + sizeof head);
+    result->stats = (int32_t *) (image + sizeof head
+                                 + buckets_size(IS_CUCKOO(result),
+                                                head.capacity));
+    result->in_image = 1;
+    result->text = image + keys;
+    result->text_size = head.keys_size;
+    result->loaded = head.keys_size;
+    ctrl = (unsigned char *) (result->stats + head.capacity);
+    if (head.group_width != 0){
+        swiss_new_ctrl(result);
+    }
+    if (head.group_width == GROUP_WIDTH){
+        memcpy(result->ctrl, ctrl, result->capacity + GROUP_WIDTH - 1);
+    }else if (head.group_width != 0){
+        /* saved by a build with other groups, the tail is different */
+        for (i = 0; i < result->capacity; i++){
+            swiss_set_ctrl(result, i, ctrl[i]);
+        }
+    }
+    if (IS_CUCKOO(result)){
+        /* the stash is filled from its start */
+        while (result->stashed < CUCKOO_STASH
+               && SLOT(result, result->capacity - CUCKOO_STASH
+                       + result->stashed)->key != NO_KEY){
+            result->stashed++;
+        }
+    }
+    result->image = image;
+    result->image_size = size;
+    result->image_mapped = mapped;
+    return result;
+}
@@ -14,14 +14,27 @@
 #include <stdio.h>
 
 typedef struct htablerec *htable;
-typedef enum hashing_e{LINEAR_P, DOUBLE_H} hashing_t;
+typedef enum hashing_e{LINEAR_P, DOUBLE_H, ROBIN_HOOD, SWISS,
+                       CUCKOO} hashing_t;
+typedef enum hashfn_e{HASH_31, HASH_FNV1A, HASH_WORD64, HASH_XXH} hashfn_t;
 
 extern void htable_free(htable h);
 extern int htable_insert(htable h, char *str);
-extern htable htable_new(int capacity, hashing_t m);
+extern htable htable_new(int capacity, hashing_t m, hashfn_t hash);
+extern int htable_hash_by_name(const char *name, hashfn_t *hash);
 extern void htable_print(htable h, void f(int x,char *str));
 extern int htable_search(htable h, char *str);
+extern void htable_search_batch(htable h, char **words, int n, int *results);
 extern void htable_print_entire_table(htable h);
 extern void htable_print_stats(htable h, FILE *stream, int num_stats);
+extern void htable_print_hash_times(htable h, FILE *stream);
+extern void htable_set_max_load(htable h, double max_load);
+extern int htable_num_keys(htable h);
+extern void htable_merge(htable dst, htable src);
+extern int htable_set_shared(htable h);
+extern void htable_end_shared(htable h);
+extern int htable_set_pow2(htable h);
+extern int htable_save(htable h, FILE *out);
+extern htable htable_load(FILE *in);
 
 #endif
@@ -9,11 +9,147 @@
  *                                                      *
 \********************************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <ctype.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "mylib.h"
+
+/* the size of the buffer the drivers give getword, words longer
+   than WORD_LIMIT - 1 characters are split in the same way */
+#define WORD_LIMIT 256
+
+/* isalnum and tolower for the "C" locale the programs run in, without
+   a function call or table lookup per character. Setting the 0x20 bit
+   lowercases a letter and leaves a digit as it is */
+#define IS_WORD_CHAR(c) ((unsigned char) (((c) | 0x20) - 'a') < 26 || \
+                         (unsigned char) ((c) - '0') < 10)
+#define WORD_LOWER(c) ((char) ((c) | 0x20))
+
+/* how many bytes of text the vector kernel classifies at once */
+#if defined(__AVX2__)
+#define BLOCK_WIDTH 32
+#define BLOCK_ALL 0xFFFFFFFFul
+#elif defined(__SSE2__)
+#define BLOCK_WIDTH 16
+#define BLOCK_ALL 0xFFFFul
+#endif
+#define BLOCK_NONE (~0ul)
+
+/* a block of memory that strings are handed out of in order */
+struct arena_chunk{
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+};
+
+struct arenarec{
+    size_t chunk_size;
+    struct arena_chunk *first;
+    struct arena_chunk *last;
+};
+
+/* hands out words either from text in memory, tokenized in place,
+   or from a stream through getword when it cannot be mapped */
+struct wordreaderrec{
+    FILE *stream;/*NULL when reading from memory*/
+    char *pos;
+    char *end;
+    char *map;/*set if the memory was mapped by wordreader_open*/
+    size_t map_size;
+    int simd;/*use the vector kernel when it is built in*/
+    char *block;/*the last block the vector kernel classified*/
+    unsigned long mask;/*which bytes of the block are word characters*/
+    char word[WORD_LIMIT];/*for words that cannot be ended in place*/
+};
+
+/* a single-producer/single-consumer queue of pointers. Each index is
+   only written by one side, the other side reads it atomically */
+struct ringrec{
+    void **items;
+    size_t size;/*a power of two*/
+    size_t head;/*the next item to pop, moved by the consumer*/
+    size_t tail;/*the next free place, moved by the producer*/
+};
+
+/* a piece of the input, cut where no word is split */
+struct text_block{
+    char *text;
+    size_t len;
+};
+
+/* the words of one text block, each ended by a '\0' */
+struct word_batch{
+    char *words;
+    size_t len;
+};
+
+/* one tokenizer thread and the queues to and from it */
+struct pipe_stage{
+    struct ringrec *blocks;
+    struct ringrec *batches;
+    pthread_t id;
+};
+
+/* reads a stream with one thread, tokenizes it with several and hands
+   out the words in order. Blocks are dealt to the tokenizers in turn
+   and their batches are collected in the same turn */
+struct pipelinerec{
+    FILE *stream;
+    int tokenizers;
+    struct pipe_stage *stages;
+    pthread_t reader;
+    int turn;/*the stage the next batch comes from*/
+    int done;
+    struct word_batch *batch;
+    char *pos;
+    char *end;
+};
+
+/* one piece of a text being spell checked and the words in it that
+   the dictionary does not know, one per line */
+struct check_job{
+    char *start;
+    size_t len;
+    void (*lookup)(void *dict, char **words, int n, int *found);
+    void *dict;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int unknown;
+};
+
+#define CHECK_BATCH 64
+
+#define PIPE_BLOCK (1 << 20)
+#define PIPE_DEPTH 4
+
+#define ARENA_DEFAULT_CHUNK 65536
+#define CHUNK_DATA(c) ((char *) ((c) + 1))
+
+/* alignment that suits any object handed out by arena_alloc */
+union arena_align{
+    long l;
+    double d;
+    void *p;
+};
+#define ARENA_ALIGN (sizeof (union arena_align))
+
 /**
  * allocate memory for an object of given size.
  *
@@ -76,3 +212,953 @@ int getword(char *s, int limit, FILE *stream){
     *w = '\0';
     return w - s;
 }
+
+/**
+ * read the whole of a stream into memory.
+ *
+ * @param stream where to read from.
+ * @param size set to the number of bytes read.
+ *
+ * @return buf the bytes read, to be freed by the caller.
+ */
+char *read_stream(FILE *stream, size_t *size){
+    size_t cap = 65536;
+    size_t n = 0;
+    char *buf = emalloc(cap);
+    size_t got;
+    while((got = fread(buf + n, 1, cap - n, stream)) > 0){
+        n += got;
+        if(n == cap){
+            cap *= 2;
+            buf = erealloc(buf, cap);
+        }
+    }
+    *size = n;
+    return buf;
+}
+
+/**
+ * map a stream that reads from a regular file into memory, privately
+ * so the mapping can be written to without changing the file. The
+ * stream is left at its end, as if it had been read.
+ *
+ * @param stream the stream to map.
+ * @param size set to the number of bytes mapped.
+ *
+ * @return the mapped bytes, or NULL if the stream is not a regular
+ * file, is empty or has already been partly read.
+ */
+char *map_stream(FILE *stream, size_t *size){
+    struct stat st;
+    int fd = fileno(stream);
+    off_t at;
+    char *map;
+    if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+        return NULL;
+    }
+    at = ftell(stream);
+    if(at != 0 || st.st_size == 0){
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(MAP_FAILED == map){
+        return NULL;
+    }
+    fseek(stream, 0, SEEK_END);
+    *size = st.st_size;
+    return map;
+}
+
+/**
+ * release memory mapped by map_stream.
+ *
+ * @param buf the mapped bytes.
+ * @param size the number of bytes mapped.
+ */
+void unmap_stream(char *buf, size_t size){
+    munmap(buf, size);
+}
+
+/**
+ * find the first place at or after pos where getword could not be in
+ * the middle of a word, so the text can be split there and each part
+ * read with getword gives the same words as reading it whole.
+ *
+ * @param buf the text.
+ * @param size the length of the text.
+ * @param pos where to start looking.
+ *
+ * @return the position of the first character that is neither a
+ * letter, digit or apostrophe, or size if there is none.
+ */
+size_t next_boundary(const char *buf, size_t size, size_t pos){
+    while(pos < size && (isalnum((unsigned char) buf[pos]) ||
+                         '\'' == buf[pos])){
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * the time in seconds since some fixed point, as measured by a wall
+ * clock. Unlike clock() this does not add up the time of every thread.
+ *
+ * @return the current time in seconds.
+ */
+double wall_time(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * create a new arena that hands out memory from chunks of the given size.
+ *
+ * @param chunk_size the size of each chunk, 0 for the default.
+ *
+ * @return result the new, empty arena.
+ */
+arena arena_new(size_t chunk_size){
+    arena result = emalloc(sizeof *result);
+    result->chunk_size = chunk_size > 0 ? chunk_size : ARENA_DEFAULT_CHUNK;
+    result->first = NULL;
+    result->last = NULL;
+    return result;
+}
+
+/**
+ * add a new chunk to the end of the arena, big enough for at least
+ * need bytes.
+ *
+ * @param a the arena to add a chunk to.
+ * @param need the number of bytes that must fit in the new chunk.
+ */
+static void arena_add_chunk(arena a, size_t need){
+    size_t size = need > a->chunk_size ? need : a->chunk_size;
+    struct arena_chunk *c = emalloc(sizeof *c + size);
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    if(a->last == NULL){
+        a->first = c;
+    }else{
+        a->last->next = c;
+    }
+    a->last = c;
+}
+
+/**
+ * copy a string into the arena. The copy lives until the arena is freed.
+ *
+ * @param a the arena to copy into.
+ * @param s the string to copy.
+ *
+ * @return result the copy of s.
+ */
+char *arena_strdup(arena a, const char *s){
+    size_t n = strlen(s) + 1;
+    char *result;
+    if(a->last == NULL || a->last->size - a->last->used < n){
+        arena_add_chunk(a, n);
+    }
+    result = CHUNK_DATA(a->last) + a->last->used;
+    a->last->used += n;
+    memcpy(result, s, n);
+    return result;
+}
+
+/**
+ * allocate a suitably aligned object from the arena. Objects of the
+ * same size allocated one after another sit next to each other,
+ * so an arena can be used as a pool of nodes.
+ *
+ * @param a the arena to allocate from.
+ * @param size the size of the object.
+ *
+ * @return result the memory for the object.
+ */
+void *arena_alloc(arena a, size_t size){
+    size_t start = 0;
+    void *result;
+    if(a->last != NULL){
+        start = (a->last->used + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    }
+    if(a->last == NULL || start > a->last->size ||
+       a->last->size - start < size){
+        arena_add_chunk(a, size);
+        start = 0;
+    }
+    result = CHUNK_DATA(a->last) + start;
+    a->last->used = start + size;
+    return result;
+}
+
+/**
+ * call f on every object in an arena that only holds objects of the
+ * given size allocated with arena_alloc, in the order they were
+ * allocated.
+ *
+ * @param a the arena to walk through.
+ * @param size the size every object was allocated with.
+ * @param f the function to call on each object.
+ * @param arg passed on to f.
+ */
+void arena_walk(arena a, size_t size, void f(void *obj, void *arg),
+                void *arg){
+    struct arena_chunk *c;
+    size_t start;
+    for(c = a->first; c != NULL; c = c->next){
+        start = 0;
+        while(start + size <= c->used){
+            f(CHUNK_DATA(c) + start, arg);
+            start = (start + size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+        }
+    }
+}
+
+/**
+ * call f on every string in an arena that only holds strings copied
+ * in with arena_strdup, in the order they were copied.
+ *
+ * @param a the arena to walk through.
+ * @param f the function to call on each string.
+ * @param arg passed on to f.
+ */
+void arena_walk_strings(arena a, void f(char *str, void *arg), void *arg){
+    struct arena_chunk *c;
+    char *p;
+    for(c = a->first; c != NULL; c = c->next){
+        for(p = CHUNK_DATA(c); p < CHUNK_DATA(c) + c->used;
+            p += strlen(p) + 1){
+            f(p, arg);
+        }
+    }
+}
+
+/**
+ * free an arena and everything that was allocated from it.
+ *
+ * @param a the arena to free.
+ */
+void arena_free(arena a){
+    struct arena_chunk *c = a->first;
+    struct arena_chunk *next;
+    while(c != NULL){
+        next = c->next;
+        free(c);
+        c = next;
+    }
+    free(a);
+}
+
+/**
+ * create a word reader for a stream. A regular file is mapped into
+ * memory and tokenized in place, anything else is read with getword.
+ *
+ * @param stream where to read words from.
+ *
+ * @return result the new word reader.
+ */
+wordreader wordreader_open(FILE *stream){
+    size_t size;
+    char *map = map_stream(stream, &size);
+    wordreader result;
+    if(map == NULL){
+        result = wordreader_mem(NULL, 0);
+        result->stream = stream;
+        return result;
+    }
+    result = wordreader_mem(map, size);
+    result->map = map;
+    result->map_size = size;
+    return result;
+}
+
+/**
+ * create a word reader for text in memory. The text is lowercased and
+ * split into words in place, so it must be writable and is changed.
+ *
+ * @param buf the text.
+ * @param size the length of the text.
+ *
+ * @return result the new word reader.
+ */
+wordreader wordreader_mem(char *buf, size_t size){
+    wordreader result = emalloc(sizeof *result);
+    result->stream = NULL;
+    result->pos = buf;
+    result->end = buf + size;
+    result->map = NULL;
+    result->map_size = 0;
+    result->simd = 1;
+    result->block = NULL;
+    result->mask = 0;
+    return result;
+}
+
+/**
+ * make a word reader use the scalar kernel even when the vector one is
+ * built in, so the two can be compared.
+ *
+ * @param r the word reader.
+ */
+void wordreader_scalar(wordreader r){
+    r->simd = 0;
+}
+
+/**
+ * name the kernel word readers tokenize memory with by default.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *wordreader_kernel(void){
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+#ifdef BLOCK_WIDTH
+/**
+ * classify a block of BLOCK_WIDTH bytes, in registers, as letters and
+ * digits or not. The tests are the unsigned ranges of IS_WORD_CHAR,
+ * moved to the bottom of the signed range for the signed compares.
+ *
+ * @param p the block, which may be unaligned.
+ * @param lower whether to write the block back with its letters
+ * lowercased.
+ *
+ * @return a mask with bit i set if byte i is a word character.
+ */
+static unsigned int block_classify(char *p, int lower){
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i case_bit = _mm256_set1_epi8(0x20);
+    __m256i letter = _mm256_cmpgt_epi8(
+        _mm256_set1_epi8((char) (-128 + 26)),
+        _mm256_add_epi8(_mm256_or_si256(v, case_bit),
+                        _mm256_set1_epi8((char) (128 - 'a'))));
+    __m256i digit = _mm256_cmpgt_epi8(
+        _mm256_set1_epi8((char) (-128 + 10)),
+        _mm256_add_epi8(v, _mm256_set1_epi8((char) (128 - '0'))));
+    if(lower){
+        _mm256_storeu_si256((__m256i *) p, _mm256_or_si256(
+                                v, _mm256_and_si256(letter, case_bit)));
+    }
+    return (unsigned int) _mm256_movemask_epi8(
+        _mm256_or_si256(letter, digit));
+#else
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i case_bit = _mm_set1_epi8(0x20);
+    __m128i letter = _mm_cmplt_epi8(
+        _mm_add_epi8(_mm_or_si128(v, case_bit),
+                     _mm_set1_epi8((char) (128 - 'a'))),
+        _mm_set1_epi8((char) (-128 + 26)));
+    __m128i digit = _mm_cmplt_epi8(
+        _mm_add_epi8(v, _mm_set1_epi8((char) (128 - '0'))),
+        _mm_set1_epi8((char) (-128 + 10)));
+    if(lower){
+        _mm_storeu_si128((__m128i *) p,
+                         _mm_or_si128(v, _mm_and_si128(letter, case_bit)));
+    }
+    return (unsigned int) _mm_movemask_epi8(_mm_or_si128(letter, digit));
+#endif
+}
+
+/**
+ * returns the position of the lowest set bit of a non-zero mask.
+ *
+ * @param mask the mask to look at.
+ *
+ * @return the index of the lowest set bit.
+ */
+static int first_bit(unsigned int mask){
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int j = 0;
+    while(!(mask & 1u)){
+        mask >>= 1;
+        j++;
+    }
+    return j;
+#endif
+}
+#endif
+
+#ifdef BLOCK_WIDTH
+/**
+ * get the classification of the text from p to the end of its block,
+ * classifying and lowercasing the BLOCK_WIDTH bytes from p as a new
+ * block if p is not in the last one. Blocks never reach past the end
+ * of the text, so near the end there may be none.
+ *
+ * @param r the word reader.
+ * @param p where in the text to look.
+ *
+ * @return a mask with bit i set if p[i] is a word character, or
+ * BLOCK_NONE if there is no block at p and it must be read a byte at
+ * a time.
+ */
+static unsigned long block_at(wordreader r, char *p){
+    if(r->block == NULL || p < r->block || p >= r->block + BLOCK_WIDTH){
+        if(!r->simd || r->end - p < BLOCK_WIDTH){
+            return BLOCK_NONE;
+        }
+        r->block = p;
+        r->mask = block_classify(p, 1);
+    }
+    return r->mask >> (p - r->block);
+}
+#endif
+
+/**
+ * find the next word character.
+ *
+ * @param r the word reader.
+ * @param p where to start looking.
+ *
+ * @return the first word character at or after p, or the end of the
+ * text if none.
+ */
+static char *skip_separators(wordreader r, char *p){
+#ifdef BLOCK_WIDTH
+    unsigned long mask;
+    while((mask = block_at(r, p)) != BLOCK_NONE){
+        if(mask != 0){
+            return p + first_bit((unsigned int) mask);
+        }
+        p = r->block + BLOCK_WIDTH;
+    }
+#endif
+    while(p < r->end && !IS_WORD_CHAR(*p)){
+        p++;
+    }
+    return p;
+}
+
+/**
+ * lowercase a run of letters and digits in place. A block is
+ * lowercased all at once when it is classified, so the letters of a
+ * block are only lowercased a byte at a time near the end of the text.
+ *
+ * @param r the word reader.
+ * @param p the start of the run.
+ * @param limit where the run must stop.
+ *
+ * @return the end of the run.
+ */
+static char *lower_run(wordreader r, char *p, char *limit){
+#ifdef BLOCK_WIDTH
+    unsigned long mask;
+    while(p < limit && (mask = block_at(r, p)) != BLOCK_NONE){
+        mask = ~mask & (BLOCK_ALL >> (p - r->block));
+        if(mask != 0){
+            p += first_bit((unsigned int) mask);
+            return p < limit ? p : limit;
+        }
+        p = r->block + BLOCK_WIDTH;
+    }
+    if(p >= limit){
+        return limit;
+    }
+#else
+    (void) r;
+#endif
+    while(p < limit && IS_WORD_CHAR(*p)){
+        *p = WORD_LOWER(*p);
+        p++;
+    }
+    return p;
+}
+
+/**
+ * get the next word from a word reader, following the same rules as
+ * getword with a WORD_LIMIT buffer: runs of letters and digits,
+ * lowercased, with apostrophes inside a word dropped. Words read from
+ * memory are lowercased and ended with a '\0' where they are, so no
+ * copy is made unless there is no room left to end them.
+ *
+ * @param r the word reader.
+ * @param word set to the word, which stays valid until the next call.
+ *
+ * @return EOF if there are no more words, otherwise the word's length.
+ */
+int wordreader_next(wordreader r, char **word){
+    char *p = r->pos;
+    char *w;
+    int n;
+    if(r->stream != NULL){
+        *word = r->word;
+        return getword(r->word, WORD_LIMIT, r->stream);
+    }
+    p = skip_separators(r, p);
+    if(p == r->end){
+        r->pos = p;
+        return EOF;
+    }
+    *word = p;
+    /* most words have no apostrophe and are lowercased where they are,
+       the rest are moved up over their apostrophes one by one */
+    p = w = lower_run(r, p, r->end - p > WORD_LIMIT - 1
+                      ? p + WORD_LIMIT - 1 : r->end);
+    n = p - *word;
+    while(n < WORD_LIMIT - 1 && p < r->end){
+        if(IS_WORD_CHAR(*p)){
+            *w++ = WORD_LOWER(*p);
+            p++;
+            n++;
+        }else if('\'' == *p){
+            p++;
+        }else{
+            break;
+        }
+    }
+    if(n < WORD_LIMIT - 1 && p < r->end){
+        p++;/* the character that ended the word is used up */
+    }
+    r->pos = p;
+    if(w == p){
+        /* no room for the '\0', the word runs to the end of the text
+           or is being split at WORD_LIMIT */
+        memcpy(r->word, *word, n);
+        *word = r->word;
+        w = r->word + n;
+    }
+    *w = '\0';
+    return n;
+}
+
+/**
+ * free a word reader, unmapping its text if it mapped it.
+ *
+ * @param r the word reader to free.
+ */
+void wordreader_close(wordreader r){
+    if(r->map != NULL){
+        unmap_stream(r->map, r->map_size);
+    }
+    free(r);
+}
+
+/**
+ * create an empty ring.
+ *
+ * @param size how many items the ring can hold, a power of two.
+ *
+ * @return the new ring.
+ */
+static struct ringrec *ring_new(size_t size){
+    struct ringrec *q = emalloc(sizeof *q);
+    q->items = emalloc(size * sizeof q->items[0]);
+    q->size = size;
+    q->head = 0;
+    q->tail = 0;
+    return q;
+}
+
+/**
+ * add an item to a ring, waiting while it is full. Only one thread
+ * may push to a ring.
+ *
+ * @param q the ring.
+ * @param item the item to add.
+ */
+static void ring_push(struct ringrec *q, void *item){
+    size_t tail = q->tail;
+    while(tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->size){
+        sched_yield();
+    }
+    q->items[tail & (q->size - 1)] = item;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * take the oldest item from a ring, waiting while it is empty. Only
+ * one thread may pop from a ring.
+ *
+ * @param q the ring.
+ *
+ * @return the item.
+ */
+static void *ring_pop(struct ringrec *q){
+    size_t head = q->head;
+    void *item;
+    while(__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head){
+        sched_yield();
+    }
+    item = q->items[head & (q->size - 1)];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+/**
+ * free a ring, which should be empty.
+ *
+ * @param q the ring.
+ */
+static void ring_free(struct ringrec *q){
+    free(q->items);
+    free(q);
+}
+
+/**
+ * find the last place in some text where getword could not be in the
+ * middle of a word, the opposite of next_boundary.
+ *
+ * @param buf the text.
+ * @param size the length of the text.
+ *
+ * @return the position just after the last character that is neither
+ * a letter, digit or apostrophe, or 0 if there is none.
+ */
+static size_t last_boundary(const char *buf, size_t size){
+    while(size > 0 && (isalnum((unsigned char) buf[size - 1]) ||
+                       '\'' == buf[size - 1])){
+        size--;
+    }
+    return size;
+}
+
+/**
+ * the reader thread of a pipeline. Reads the stream in blocks of at
+ * least PIPE_BLOCK bytes, carrying any word cut off at the end of a
+ * block over to the next, and deals them to the tokenizers in turn.
+ * A NULL block tells each tokenizer the stream has ended.
+ *
+ * @param arg the pipeline.
+ *
+ * @return NULL.
+ */
+static void *pipeline_read(void *arg){
+    struct pipelinerec *p = arg;
+    size_t cap = PIPE_BLOCK;
+    size_t len = 0;
+    size_t cut;
+    char *buf = emalloc(cap);
+    struct text_block *block;
+    int turn = 0;
+    int i;
+    int eof = 0;
+
+    while(!eof){
+        len += fread(buf + len, 1, cap - len, p->stream);
+        eof = len < cap;
+        cut = eof ? len : last_boundary(buf, len);
+        if(cut == 0 && !eof){
+            /* one word fills the block, make room for the rest of it */
+            cap *= 2;
+            buf = erealloc(buf, cap);
+            continue;
+        }
+        if(cut == 0){
+            break;
+        }
+        block = emalloc(sizeof *block);
+        block->text = buf;
+        block->len = cut;
+        if(cap > PIPE_BLOCK && len - cut < PIPE_BLOCK){
+            cap = PIPE_BLOCK;
+        }
+        buf = emalloc(cap);
+        memcpy(buf, block->text + cut, len - cut);
+        len -= cut;
+        ring_push(p->stages[turn].blocks, block);
+        turn = (turn + 1) % p->tokenizers;
+    }
+    free(buf);
+    for(i = 0; i < p->tokenizers; i++){
+        ring_push(p->stages[i].blocks, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * a tokenizer thread of a pipeline. Turns each block it is given into
+ * a batch of words, which are never longer in all than the block plus
+ * a '\0' for every WORD_LIMIT - 1 characters and the last word. Passes
+ * the NULL that ends the stream on.
+ *
+ * @param arg the stage the thread runs.
+ *
+ * @return NULL.
+ */
+static void *pipeline_tokenize(void *arg){
+    struct pipe_stage *stage = arg;
+    struct text_block *block;
+    struct word_batch *batch;
+    wordreader r;
+    char *word;
+    int n;
+
+    while((block = ring_pop(stage->blocks)) != NULL){
+        batch = emalloc(sizeof *batch);
+        batch->words = emalloc(block->len + block->len / (WORD_LIMIT - 1)
+                               + 1);
+        batch->len = 0;
+        r = wordreader_mem(block->text, block->len);
+        while((n = wordreader_next(r, &word)) != EOF){
+            memcpy(batch->words + batch->len, word, n + 1);
+            batch->len += n + 1;
+        }
+        wordreader_close(r);
+        free(block->text);
+        free(block);
+        ring_push(stage->batches, batch);
+    }
+    ring_push(stage->batches, NULL);
+    return NULL;
+}
+
+/**
+ * start reading words from a stream through a pipeline: one thread
+ * reads the stream, others tokenize what it reads, and the words are
+ * handed out by pipeline_next in the order they appear. Reading from a
+ * pipe then overlaps with whatever is done with the words.
+ *
+ * @param stream the stream to read.
+ * @param tokenizers how many threads tokenize the stream.
+ *
+ * @return result the new pipeline.
+ */
+pipeline pipeline_open(FILE *stream, int tokenizers){
+    pipeline result = emalloc(sizeof *result);
+    int i;
+
+    if(tokenizers < 1){
+        tokenizers = 1;
+    }
+    result->stream = stream;
+    result->tokenizers = tokenizers;
+    result->stages = emalloc(tokenizers * sizeof result->stages[0]);
+    result->turn = 0;
+    result->done = 0;
+    result->batch = NULL;
+    result->pos = result->end = NULL;
+    for(i = 0; i < tokenizers; i++){
+        result->stages[i].blocks = ring_new(PIPE_DEPTH);
+        result->stages[i].batches = ring_new(PIPE_DEPTH);
+        if(pthread_create(&result->stages[i].id, NULL, pipeline_tokenize,
+                          &result->stages[i]) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(pthread_create(&result->reader, NULL, pipeline_read, result) != 0){
+        fprintf(stderr, "Thread creation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+/**
+ * get the next word from a pipeline, with the same words as getword
+ * would give.
+ *
+ * @param p the pipeline.
+ * @param word set to the word, which stays valid until the next call.
+ *
+ * @return EOF if there are no more words, otherwise the word's length.
+ */
+int pipeline_next(pipeline p, char **word){
+    int n;
+    while(p->pos == p->end){
+        if(p->done){
+            return EOF;
+        }
+        if(p->batch != NULL){
+            free(p->batch->words);
+            free(p->batch);
+        }
+        p->batch = ring_pop(p->stages[p->turn].batches);
+        if(p->batch == NULL){
+            /* the turns are the reader's, so the first stage to finish
+               is the one the stream ended at */
+            p->done = 1;
+            p->pos = p->end = NULL;
+            return EOF;
+        }
+        p->turn = (p->turn + 1) % p->tokenizers;
+        p->pos = p->batch->words;
+        p->end = p->pos + p->batch->len;
+    }
+    *word = p->pos;
+    n = strlen(p->pos);
+    p->pos += n + 1;
+    return n;
+}
+
+/**
+ * finish with a pipeline, reading any words that are left so its
+ * threads can end. The stages other than the last one are left with
+ * their NULL batch unread, which is all their rings hold.
+ *
+ * @param p the pipeline to free.
+ */
+void pipeline_close(pipeline p){
+    char *word;
+    int i;
+    while(pipeline_next(p, &word) != EOF){
+        /* the stages cannot end until their batches are taken */
+    }
+    pthread_join(p->reader, NULL);
+    for(i = 0; i < p->tokenizers; i++){
+        pthread_join(p->stages[i].id, NULL);
+        ring_free(p->stages[i].blocks);
+        ring_free(p->stages[i].batches);
+    }
+    free(p->stages);
+    free(p);
+}
+
+/**
+ * look up a batch of words from a piece of a text being checked and
+ * note down the ones the dictionary does not know.
+ *
+ * @param job the piece the words come from.
+ * @param words the words.
+ * @param n how many words there are, at most CHECK_BATCH.
+ */
+static void check_batch(struct check_job *job, char **words, int n){
+    int found[CHECK_BATCH];
+    size_t len;
+    int i;
+    job->lookup(job->dict, words, n, found);
+    for(i = 0; i < n; i++){
+        if(found[i]){
+            continue;
+        }
+        len = strlen(words[i]);
+        while(job->out_len + len + 1 > job->out_cap){
+            job->out_cap = job->out_cap == 0 ? 4096 : 2 * job->out_cap;
+            job->out = erealloc(job->out, job->out_cap);
+        }
+        memcpy(job->out + job->out_len, words[i], len);
+        job->out[job->out_len + len] = '\n';
+        job->out_len += len + 1;
+        job->unknown++;
+    }
+}
+
+/**
+ * Thread body for a parallel check, looks up every word of its piece
+ * of the text in batches. Words a word reader could not end in place
+ * are copied, since it reuses the space they are in.
+ *
+ * @param arg the check_job to work on.
+ *
+ * @return NULL.
+ */
+static void *check_piece(void *arg){
+    struct check_job *job = arg;
+    char *words[CHECK_BATCH];
+    char *word;
+    int n = 0;
+    arena spill = NULL;
+    wordreader r = wordreader_mem(job->start, job->len);
+
+    while(wordreader_next(r, &word) != EOF){
+        if(word < job->start || word >= job->start + job->len){
+            if(spill == NULL){
+                spill = arena_new(0);
+            }
+            word = arena_strdup(spill, word);
+        }
+        words[n++] = word;
+        if(n == CHECK_BATCH){
+            check_batch(job, words, n);
+            n = 0;
+            if(spill != NULL){
+                arena_free(spill);
+                spill = NULL;
+            }
+        }
+    }
+    if(n > 0){
+        check_batch(job, words, n);
+    }
+    if(spill != NULL){
+        arena_free(spill);
+    }
+    wordreader_close(r);
+    return NULL;
+}
+
+/**
+ * spell check a stream against a dictionary that no longer changes.
+ * The text is split at word boundaries into a piece for each thread,
+ * the pieces are checked at the same time, then the unknown words are
+ * written out piece by piece, so they come out in the order they are
+ * in the text.
+ *
+ * @param stream the text to check.
+ * @param threads the number of threads to use.
+ * @param lookup sets found[i] to whether the dictionary knows words[i]
+ * for each of n words. It is called from several threads at once.
+ * @param dict passed on to lookup.
+ * @param out where to write the unknown words, one per line.
+ *
+ * @return the number of unknown words.
+ */
+int check_words(FILE *stream, int threads,
+                void lookup(void *dict, char **words, int n, int *found),
+                void *dict, FILE *out){
+    size_t size, pos = 0, end;
+    char *buf = map_stream(stream, &size);
+    int mapped = (buf != NULL);
+    struct check_job *jobs;
+    pthread_t *ids;
+    int i, n = 0, unknown = 0;
+
+    if(!mapped){
+        buf = read_stream(stream, &size);
+    }
+    if(threads < 1){
+        threads = 1;
+    }
+    jobs = emalloc(threads * sizeof jobs[0]);
+    ids = emalloc(threads * sizeof ids[0]);
+    for(i = 0; i < threads && pos < size; i++){
+        end = next_boundary(buf, size, pos + (size - pos) / (threads - i));
+        jobs[n].start = buf + pos;
+        jobs[n].len = end - pos;
+        jobs[n].lookup = lookup;
+        jobs[n].dict = dict;
+        jobs[n].out = NULL;
+        jobs[n].out_len = jobs[n].out_cap = 0;
+        jobs[n].unknown = 0;
+        n++;
+        pos = end;
+    }
+    /* the last piece is checked on this thread */
+    for(i = 0; i < n - 1; i++){
+        if(pthread_create(&ids[i], NULL, check_piece, &jobs[i]) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(n > 0){
+        check_piece(&jobs[n - 1]);
+    }
+    for(i = 0; i < n; i++){
+        if(i < n - 1){
+            pthread_join(ids[i], NULL);
+        }
+        if(jobs[i].out_len > 0){
+            fwrite(jobs[i].out, 1, jobs[i].out_len, out);
+        }
+        unknown += jobs[i].unknown;
+        free(jobs[i].out);
+    }
+    free(ids);
+    free(jobs);
+    if(mapped){
+        unmap_stream(buf, size);
+    }else{
+        free(buf);
+    }
+    return unknown;
+}
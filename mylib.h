@@ -13,8 +13,38 @@
 
 #include <stddef.h>
 
+typedef struct arenarec *arena;
+typedef struct wordreaderrec *wordreader;
+typedef struct pipelinerec *pipeline;
+
 extern void *emalloc(size_t);
 extern void *erealloc(void *, size_t);
 extern int getword(char*, int, FILE *);
+extern char *read_stream(FILE *stream, size_t *size);
+extern char *map_stream(FILE *stream, size_t *size);
+extern void unmap_stream(char *buf, size_t size);
+extern wordreader wordreader_open(FILE *stream);
+extern wordreader wordreader_mem(char *buf, size_t size);
+extern int wordreader_next(wordreader r, char **word);
+extern void wordreader_scalar(wordreader r);
+extern const char *wordreader_kernel(void);
+extern void wordreader_close(wordreader r);
+extern pipeline pipeline_open(FILE *stream, int tokenizers);
+extern int pipeline_next(pipeline p, char **word);
+extern void pipeline_close(pipeline p);
+extern int check_words(FILE *stream, int threads,
+                       void lookup(void *dict, char **words, int n,
+                                   int *found),
+                       void *dict, FILE *out);
+extern size_t next_boundary(const char *buf, size_t size, size_t pos);
+extern double wall_time(void);
+extern arena arena_new(size_t chunk_size);
+extern char *arena_strdup(arena a, const char *s);
+extern void *arena_alloc(arena a, size_t size);
+extern void arena_walk(arena a, size_t size, void f(void *obj, void *arg),
+                       void *arg);
+extern void arena_walk_strings(arena a, void f(char *str, void *arg),
+                               void *arg);
+extern void arena_free(arena a);
 
 #endif
@@ -0,0 +1,371 @@
+/********************************************************\
+ * phash.c --  a minimal perfect hash of a fixed set of *
+ *             keys, found with one probe               *
+ *                                                      *
+ * Authors:    James Douglas, Paul Souter,              *
+ *             Ryan Swanepoel                           *
+ *                                                      *
+ * Purpose:    to compile a dictionary that will not    *
+ *             change again into the smallest table     *
+ *             that can be searched for its words       *
+ *                                                      *
+\********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mylib.h"
+#include "phash.h"
+
+/* the keys are split into buckets of about this many, and each
+   bucket gets a pilot that sends its keys to free slots */
+#define KEYS_PER_BUCKET 3
+#define MAX_PILOT 0x7FFFFFFFu
+/* number of keys phash_search_batch hashes before resolving any */
+#define BATCH 16
+
+#define MIX_K1 UINT64_C(0xff51afd7ed558ccd)
+#define MIX_K2 UINT64_C(0xc4ceb9fe1a85ec53)
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) 0)
+#endif
+
+/* one slot for each key. The top half of the key's hash is kept, so
+   most words that are not keys are turned away without reading the
+   key's text */
+struct slot{
+    uint32_t check;
+    uint32_t key;/*offset of the key in text*/
+    int32_t freq;
+};
+
+struct phashrec{
+    uint32_t *pilots;/*one for each bucket*/
+    uint32_t num_buckets;
+    struct slot *slots;/*exactly one for each key*/
+    uint32_t num_keys;
+    char *text;/*the text of the keys, one after another*/
+    size_t text_size;
+};
+
+/**
+ * hashes a key to 64 bits with FNV-1a and a final mix. The low half
+ * chooses the bucket and the high half is kept to check against.
+ *
+ * @param key the key to hash.
+ *
+ * @return the hash of key.
+ */
+static uint64_t phash_hash(const char *key){
+    uint64_t h = UINT64_C(14695981039346656037);
+    while(*key != '\0'){
+        h = (h ^ (unsigned char) *key++) * UINT64_C(1099511628211);
+    }
+    h ^= h >> 33;
+    h *= MIX_K1;
+    h ^= h >> 33;
+    h *= MIX_K2;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * finds the bucket of a hash, by scaling its low half to the number
+ * of buckets rather than taking a remainder.
+ *
+ * @param p the perfect hash.
+ * @param h the hash of a key.
+ *
+ * @return the bucket.
+ */
+static uint32_t phash_bucket(phash p, uint64_t h){
+    return (uint32_t) (((h & 0xFFFFFFFFu) * p->num_buckets) >> 32);
+}
+
+/**
+ * finds the slot a hash goes to with a given pilot: the hash mixed
+ * with the pilot, scaled to the number of keys.
+ *
+ * @param p the perfect hash.
+ * @param h the hash of a key.
+ * @param pilot the pilot of the key's bucket.
+ *
+ * @return the slot.
+ */
+static uint32_t phash_position(phash p, uint64_t h, uint32_t pilot){
+    uint64_t x = h ^ ((uint64_t) pilot * MIX_K2);
+    x ^= x >> 33;
+    x *= MIX_K1;
+    x ^= x >> 33;
+    return (uint32_t) (((x >> 32) * p->num_keys) >> 32);
+}
+
+/**
+ * finds a pilot for each bucket, largest buckets first while most
+ * slots are still free, such that the keys of the bucket go to
+ * different slots that no earlier bucket has taken.
+ *
+ * @param p the perfect hash being built.
+ * @param hashes the hashes of the keys.
+ * @param order the keys sorted by bucket.
+ * @param start where each bucket starts in order, and where the last
+ * one ends.
+ * @param by_size the buckets, largest first.
+ * @param slot_key set to the key that went to each slot.
+ *
+ * @return 1 if every bucket got a pilot, 0 if one could not.
+ */
+static int phash_place(phash p, uint64_t *hashes, int *order,
+                       uint32_t *start, uint32_t *by_size, int *slot_key){
+    char *taken = emalloc(p->num_keys + 1);
+    uint32_t *pos = NULL;
+    uint32_t b, i, j, k, size, pilot;
+    int result = 1;
+
+    memset(taken, 0, p->num_keys + 1);
+    for(i = 0; i < p->num_buckets && result; i++){
+        b = by_size[i];
+        size = start[b + 1] - start[b];
+        if(i == 0){
+            pos = emalloc((size + 1) * sizeof pos[0]);
+        }
+        /* keys with the same hash can never be given different slots */
+        for(j = 0; j < size && result; j++){
+            for(k = j + 1; k < size; k++){
+                if(hashes[order[start[b] + j]] == hashes[order[start[b] + k]]){
+                    result = 0;
+                }
+            }
+        }
+        for(pilot = 0; pilot < MAX_PILOT && result && size > 0; pilot++){
+            for(j = 0; j < size; j++){
+                pos[j] = phash_position(p, hashes[order[start[b] + j]], pilot);
+                if(taken[pos[j]]){
+                    break;
+                }
+                taken[pos[j]] = 1;
+            }
+            if(j == size){
+                break;
+            }
+            while(j > 0){
+                taken[pos[--j]] = 0;
+            }
+        }
+        if(pilot == MAX_PILOT){
+            result = 0;
+        }
+        p->pilots[b] = pilot;
+        for(j = 0; j < size && result; j++){
+            slot_key[pos[j]] = order[start[b] + j];
+        }
+    }
+    free(pos);
+    free(taken);
+    return result;
+}
+
+/**
+ * compiles a set of keys into a minimal perfect hash: a pilot for each
+ * bucket of about KEYS_PER_BUCKET keys, one slot for each key holding
+ * a check of its hash, where its text is and its frequency, and the
+ * text of the keys. A search finds the only slot its word can be in
+ * from the word's hash and the pilot of its bucket. The keys are
+ * copied, so the caller's copies can be freed afterwards.
+ *
+ * @param keys the keys, all different.
+ * @param freqs the frequency of each key, given back by a search.
+ * @param n the number of keys.
+ *
+ * @return the perfect hash, or NULL if one could not be built, which
+ * only happens if two keys have the same 64 bit hash or their text
+ * is too long in all.
+ */
+phash phash_new(char **keys, int *freqs, int n){
+    phash result = emalloc(sizeof *result);
+    uint64_t *hashes = emalloc((n + 1) * sizeof hashes[0]);
+    int *order = emalloc((n + 1) * sizeof order[0]);
+    int *slot_key = emalloc((n + 1) * sizeof slot_key[0]);
+    uint32_t *start, *fill, *by_size, *size_start;
+    uint32_t b, max_size = 0;
+    size_t len;
+    int i, ok;
+
+    result->num_keys = n;
+    result->num_buckets = n / KEYS_PER_BUCKET + 1;
+    result->pilots = emalloc(result->num_buckets * sizeof result->pilots[0]);
+    result->slots = emalloc((n + 1) * sizeof result->slots[0]);
+    result->text_size = 0;
+    start = emalloc((result->num_buckets + 1) * sizeof start[0]);
+    fill = emalloc(result->num_buckets * sizeof fill[0]);
+    by_size = emalloc(result->num_buckets * sizeof by_size[0]);
+
+    /* sort the keys by bucket */
+    for(b = 0; b < result->num_buckets; b++){
+        fill[b] = 0;
+    }
+    for(i = 0; i < n; i++){
+        hashes[i] = phash_hash(keys[i]);
+        fill[phash_bucket(result, hashes[i])]++;
+        result->text_size += strlen(keys[i]) + 1;
+    }
+    start[0] = 0;
+    for(b = 0; b < result->num_buckets; b++){
+        start[b + 1] = start[b] + fill[b];
+        if(fill[b] > max_size){
+            max_size = fill[b];
+        }
+        fill[b] = start[b];
+    }
+    for(i = 0; i < n; i++){
+        order[fill[phash_bucket(result, hashes[i])]++] = i;
+    }
+
+    /* then the buckets by size, largest first */
+    size_start = emalloc((max_size + 2) * sizeof size_start[0]);
+    memset(size_start, 0, (max_size + 2) * sizeof size_start[0]);
+    for(b = 0; b < result->num_buckets; b++){
+        size_start[max_size - (start[b + 1] - start[b]) + 1]++;
+    }
+    for(b = 1; b <= max_size + 1; b++){
+        size_start[b] += size_start[b - 1];
+    }
+    for(b = 0; b < result->num_buckets; b++){
+        by_size[size_start[max_size - (start[b + 1] - start[b])]++] = b;
+    }
+
+    ok = result->text_size <= UINT32_MAX
+        && phash_place(result, hashes, order, start, by_size, slot_key);
+    if(ok){
+        result->text = emalloc(result->text_size + 1);
+        len = 0;
+        for(i = 0; i < n; i++){
+            result->slots[i].check = (uint32_t) (hashes[slot_key[i]] >> 32);
+            result->slots[i].key = (uint32_t) len;
+            result->slots[i].freq = freqs[slot_key[i]];
+            strcpy(result->text + len, keys[slot_key[i]]);
+            len += strlen(keys[slot_key[i]]) + 1;
+        }
+    }
+    free(size_start);
+    free(by_size);
+    free(fill);
+    free(start);
+    free(slot_key);
+    free(order);
+    free(hashes);
+    if(!ok){
+        free(result->slots);
+        free(result->pilots);
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * finds the only slot a hashed key can be in.
+ *
+ * @param p the perfect hash.
+ * @param h the hash of the key.
+ *
+ * @return the slot.
+ */
+static struct slot *phash_slot(phash p, uint64_t h){
+    return &p->slots[phash_position(p, h, p->pilots[phash_bucket(p, h)])];
+}
+
+/**
+ * searches for a key.
+ *
+ * @param p the perfect hash.
+ * @param key the key to search for.
+ *
+ * @return the frequency of the key, 0 if it is not one of the keys.
+ */
+int phash_search(phash p, const char *key){
+    uint64_t h = phash_hash(key);
+    struct slot *s;
+    if(p->num_keys == 0){
+        return 0;
+    }
+    s = phash_slot(p, h);
+    if(s->check != (uint32_t) (h >> 32) || strcmp(p->text + s->key, key) != 0){
+        return 0;
+    }
+    return s->freq;
+}
+
+/**
+ * searches for several keys, BATCH at a time: the pilots of a group
+ * are prefetched, then their slots, then the text of the keys whose
+ * checks match, before any key is compared.
+ *
+ * @param p the perfect hash.
+ * @param keys the keys to search for.
+ * @param n the number of keys.
+ * @param results set to the frequency of each key, 0 if it is not one
+ * of the keys.
+ */
+void phash_search_batch(phash p, char **keys, int n, int *results){
+    uint64_t hashes[BATCH];
+    struct slot *slots[BATCH];
+    int i, j, m;
+    if(p->num_keys == 0){
+        for(i = 0; i < n; i++){
+            results[i] = 0;
+        }
+        return;
+    }
+    for(i = 0; i < n; i += m){
+        m = (n - i < BATCH) ? n - i : BATCH;
+        for(j = 0; j < m; j++){
+            hashes[j] = phash_hash(keys[i + j]);
+            PREFETCH(&p->pilots[phash_bucket(p, hashes[j])]);
+        }
+        for(j = 0; j < m; j++){
+            slots[j] = phash_slot(p, hashes[j]);
+            PREFETCH(slots[j]);
+        }
+        for(j = 0; j < m; j++){
+            if(slots[j]->check == (uint32_t) (hashes[j] >> 32)){
+                PREFETCH(p->text + slots[j]->key);
+            }
+        }
+        for(j = 0; j < m; j++){
+            results[i + j] = 0;
+            if(slots[j]->check == (uint32_t) (hashes[j] >> 32)
+               && strcmp(p->text + slots[j]->key, keys[i + j]) == 0){
+                results[i + j] = slots[j]->freq;
+            }
+        }
+    }
+}
+
+/**
+ * works out how much memory the perfect hash takes.
+ *
+ * @param p the perfect hash.
+ *
+ * @return the size of the pilots, slots and text in bytes.
+ */
+size_t phash_size(phash p){
+    return sizeof *p + p->num_buckets * sizeof p->pilots[0]
+        + p->num_keys * sizeof p->slots[0] + p->text_size;
+}
+
+/**
+ * frees the perfect hash.
+ *
+ * @param p the perfect hash to free.
+ */
+void phash_free(phash p){
+    free(p->pilots);
+    free(p->slots);
+    free(p->text);
+    free(p);
+}
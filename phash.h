@@ -0,0 +1,24 @@
+/********************************************************\
+ * phash.h -- declaration file for phash.c              *
+ *                                                      *
+ * Authors:    James Douglas, Paul Souter,              *
+ *             Ryan Swanepoel                           *
+ *                                                      *
+ * Purpose:    to declare each function in phash.c      *
+ *                                                      *
+\********************************************************/
+
+#ifndef PHASH_H_
+#define PHASH_H_
+
+#include <stddef.h>
+
+typedef struct phashrec *phash;
+
+extern phash phash_new(char **keys, int *freqs, int n);
+extern int phash_search(phash p, const char *key);
+extern void phash_search_batch(phash p, char **keys, int n, int *results);
+extern size_t phash_size(phash p);
+extern void phash_free(phash p);
+
+#endif
@@ -0,0 +1,306 @@
+/********************************************************\
+ * sharedcheck-main --checks a shared hash table while  *
+ *                   it is searched and inserted into.  *
+ *                                                      *
+ * Authors:    James Douglas, Paul Souter,              *
+ *             Ryan Swanepoel                           *
+ *                                                      *
+ * Purpose:    to count the words of a text into a      *
+ *             shared table on several threads while    *
+ *             others search it, and check every search *
+ *             against the counts one thread makes.     *
+ *             Exits with EXIT_FAILURE if any were      *
+ *             wrong.                                   *
+ *                                                      *
+ * Build:                                               *
+ *      gcc -std=c99 -pthread -o sharedcheck            *
+ *          sharedcheck-main.c htable.c mylib.c         *
+ *                                                      *
+ * Usage:                                               *
+ *      ./sharedcheck [OPTION]... <STDIN>               *
+ *      e.g. ./sharedcheck -w 8 -r 4 < words.txt        *
+\********************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "mylib.h"
+#include "htable.h"
+
+#define DEFAULT_WRITERS 4
+#define DEFAULT_READERS 2
+/* small, so that the table has to grow while it is being searched */
+#define DEFAULT_CAPACITY 7
+
+/* a piece of the words of the text, inserted by one writer */
+struct writer_job {
+    char **words;
+    int n;
+};
+
+/* what one reader saw */
+struct reader_job {
+    int *last;/*the last frequency seen for each key*/
+    long searches;
+    long errors;
+};
+
+/* the table being checked */
+static htable shared;
+
+/* every word of the text, and each different one with its frequency as
+   counted by one thread */
+static char **words = NULL;
+static int num_words = 0;
+static char **keys = NULL;
+static int *freqs = NULL;
+static int num_keys = 0;
+
+/* the number of writers still inserting */
+static int writers_left;
+
+/**
+ * collects a key of the table counted by one thread, and its
+ * frequency.
+ *
+ * @param freq the frequency of the key.
+ * @param word the key.
+ */
+static void collect_key(int freq, char *word){
+    keys = erealloc(keys, (num_keys + 1) * sizeof keys[0]);
+    freqs = erealloc(freqs, (num_keys + 1) * sizeof freqs[0]);
+    keys[num_keys] = word;
+    freqs[num_keys++] = freq;
+}
+
+/**
+ * counts a key of a table.
+ *
+ * @param freq the frequency of the key.
+ * @param word the key.
+ */
+static void count_key(int freq, char *word){
+    (void) freq;
+    (void) word;
+    num_keys--;
+}
+
+/**
+ * Thread body for a writer, inserts its piece of the words into the
+ * shared table.
+ *
+ * @param arg the writer_job to work on.
+ *
+ * @return NULL.
+ */
+static void *write_words(void *arg){
+    struct writer_job *job = arg;
+    int i;
+    for(i = 0; i < job->n; i++){
+        if(htable_insert(shared, job->words[i]) == 0){
+            fprintf(stderr, "sharedcheck: no room for %s\n", job->words[i]);
+        }
+    }
+    __atomic_fetch_sub(&writers_left, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Thread body for a reader, searches for every key over and over
+ * until the writers are done. A key's frequency must never go down
+ * between searches, nor go past the frequency it ends up with.
+ *
+ * @param arg the reader_job to work on.
+ *
+ * @return NULL.
+ */
+static void *read_words(void *arg){
+    struct reader_job *job = arg;
+    int done, f, i;
+    do{
+        done = (__atomic_load_n(&writers_left, __ATOMIC_ACQUIRE) == 0);
+        for(i = 0; i < num_keys; i++){
+            f = htable_search(shared, keys[i]);
+            if(f < job->last[i] || f > freqs[i]){
+                if(job->errors++ == 0){
+                    fprintf(stderr, "sharedcheck: %s went from %d to %d"
+                            " of %d\n", keys[i], job->last[i], f, freqs[i]);
+                }
+            }
+            job->last[i] = f;
+            job->searches++;
+        }
+    }while(!done);
+    return NULL;
+}
+
+/**
+ * Checks that the shared table has the frequency counted by one
+ * thread for every key, and no other keys.
+ *
+ * @param when what has been done to the table, for the message.
+ *
+ * @return the number of keys that are wrong.
+ */
+static long check_all(const char *when){
+    long errors = 0;
+    int f, i, n = num_keys;
+    for(i = 0; i < n; i++){
+        f = htable_search(shared, keys[i]);
+        if(f != freqs[i] && errors++ == 0){
+            fprintf(stderr, "sharedcheck: %s has %d for %s, not %d\n",
+                    when, f, keys[i], freqs[i]);
+        }
+    }
+    return errors;
+}
+
+/**
+ * Prints the help message for the program.
+ */
+static void print_help(void){
+    fprintf(stderr, "Usage: ./sharedcheck [OPTION]... <STDIN>\n\n");
+    fprintf(stderr, "Count the words read from stdin into a shared hash");
+    fprintf(stderr, " table on several threads\nwhile others search it,");
+    fprintf(stderr, " and check every search against one thread's\n");
+    fprintf(stderr, "counts.\n\n");
+    fprintf(stderr, " -d\t\tUse double hashing\n");
+    fprintf(stderr, " -r READERS\tSearch on READERS threads (default %d)\n",
+            DEFAULT_READERS);
+    fprintf(stderr, " -t TABLESIZE\tStart the table at TABLESIZE");
+    fprintf(stderr, " (default %d)\n", DEFAULT_CAPACITY);
+    fprintf(stderr, " -w WRITERS\tInsert on WRITERS threads (default %d)\n",
+            DEFAULT_WRITERS);
+    fprintf(stderr, " -h\t\tPrint this message\n\n");
+}
+
+/**
+ * Main method. Counts the words of stdin on one thread, then again on
+ * the writers while the readers search, and checks the two agree.
+ *
+ * @param argc the number of arguments.
+ * @param argv the arguments.
+ *
+ * @return EXIT_SUCCESS if every search found what it should have.
+ */
+int main(int argc, char **argv){
+    const char *optstring = "dr:t:w:h";
+    int num_writers = DEFAULT_WRITERS;
+    int num_readers = DEFAULT_READERS;
+    int capacity = DEFAULT_CAPACITY;
+    hashing_t method = LINEAR_P;
+    struct writer_job *writers;
+    struct reader_job *readers;
+    pthread_t *ids;
+    htable counted;
+    arena text_words = arena_new(0);
+    char word[256];
+    long searches = 0, errors = 0;
+    int i, start;
+    char option;
+
+    while((option = getopt(argc, argv, optstring)) != EOF){
+        switch(option){
+            case 'd':
+                method = DOUBLE_H;
+                break;
+            case 'r':
+                num_readers = atoi(optarg);
+                if(num_readers < 1){
+                    num_readers = 1;
+                }
+                break;
+            case 't':
+                capacity = atoi(optarg);
+                if(capacity < 2){
+                    capacity = 2;
+                }
+                break;
+            case 'w':
+                num_writers = atoi(optarg);
+                if(num_writers < 1){
+                    num_writers = 1;
+                }
+                break;
+            case 'h':
+            default:
+                print_help();
+                return EXIT_SUCCESS;
+        }
+    }
+
+    while(getword(word, sizeof word, stdin) != EOF){
+        words = erealloc(words, (num_words + 1) * sizeof words[0]);
+        words[num_words++] = arena_strdup(text_words, word);
+    }
+    counted = htable_new(113, method, HASH_31);
+    for(i = 0; i < num_words; i++){
+        htable_insert(counted, words[i]);
+    }
+    htable_print(counted, collect_key);
+
+    shared = htable_new(capacity, method, HASH_31);
+    htable_set_shared(shared);
+    writers = emalloc(num_writers * sizeof writers[0]);
+    readers = emalloc(num_readers * sizeof readers[0]);
+    ids = emalloc((num_writers + num_readers) * sizeof ids[0]);
+    writers_left = num_writers;
+    for(i = 0; i < num_readers; i++){
+        readers[i].last = emalloc((num_keys + 1) * sizeof readers[i].last[0]);
+        memset(readers[i].last, 0, (num_keys + 1) * sizeof readers[i].last[0]);
+        readers[i].searches = 0;
+        readers[i].errors = 0;
+        if(pthread_create(&ids[num_writers + i], NULL, read_words,
+                          &readers[i]) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = start = 0; i < num_writers; i++){
+        writers[i].words = words + start;
+        writers[i].n = (num_words - start) / (num_writers - i);
+        start += writers[i].n;
+        if(pthread_create(&ids[i], NULL, write_words, &writers[i]) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = 0; i < num_writers + num_readers; i++){
+        pthread_join(ids[i], NULL);
+    }
+    for(i = 0; i < num_readers; i++){
+        searches += readers[i].searches;
+        errors += readers[i].errors;
+        free(readers[i].last);
+    }
+    errors += check_all("the shared table");
+    htable_end_shared(shared);
+    errors += check_all("the table put together");
+    /* and the table put together has no keys but those */
+    start = num_keys;
+    htable_print(shared, count_key);
+    if(num_keys != 0){
+        fprintf(stderr, "sharedcheck: the table put together has %d keys,"
+                " not %d\n", start - num_keys, start);
+        errors++;
+    }
+    num_keys = start;
+
+    fprintf(stderr, "%d words, %d different, %d writers, %d readers, %ld"
+            " searches, %ld wrong\n", num_words, num_keys, num_writers,
+            num_readers, searches, errors);
+    htable_free(shared);
+    htable_free(counted);
+    free(ids);
+    free(readers);
+    free(writers);
+    free(keys);
+    free(freqs);
+    free(words);
+    arena_free(text_words);
+    return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
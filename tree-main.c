@@ -4,21 +4,40 @@
  * Authors:    James Douglas, Paul Souter,              *
  *             Ryan Swanepoel                           *
  *                                                      *
- * Purpose:    to build an RBT or BST from inputs and   *
- *             runs methods on the tree.                *
+ * Purpose:    to build an RBT, BST or B-tree from      *
+ *             inputs and runs methods on the tree.     *
  *                                                      *
  * Usage:                                               *
  *      ./tree [OPTION]... <STDIN>                      *
 \********************************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
-#include <time.h>
+#include <pthread.h>
 #include "mylib.h"
 #include "tree.h"
+#include "bloom.h"
+
+/* options that only have a long form */
+static struct option long_options[] = {
+    {"load", required_argument, NULL, 'L'},
+    {"save", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0}
+};
 
+/* one piece of the input and the tree a thread builds from it */
+struct build_job {
+    char *start;
+    size_t len;
+    tree t;
+};
+
+/* the Bloom filter -c consults before the tree when -b is given */
+static bloom filter = NULL;
 
 /**
  * Method that checks what color the node is
@@ -31,6 +50,116 @@ void print(char *str, int f){
     fprintf(stderr, "%d\t%s\n", f, str);
 }
 
+/**
+ * adds a key of the tree to the Bloom filter.
+ *
+ * @param str the key.
+ * @param f frequency of the key.
+ */
+static void add_to_filter(char *str, int f){
+    (void) f;
+    bloom_add(filter, str);
+}
+
+/**
+ * searches the tree, for bloom_search_batch.
+ *
+ * @param dict the tree.
+ * @param words the words to look up.
+ * @param n the number of words.
+ * @param found set to whether each word is in the tree.
+ */
+static void search_tree(void *dict, char **words, int n, int *found){
+    tree_search_batch(dict, words, n, found);
+}
+
+/**
+ * looks up a batch of words in a tree for check_words, through the
+ * Bloom filter if there is one.
+ *
+ * @param dict the tree.
+ * @param words the words to look up.
+ * @param n the number of words.
+ * @param found set to whether each word is in the tree.
+ */
+static void lookup_words(void *dict, char **words, int n, int *found){
+    bloom_search_batch(filter, search_tree, dict, words, n, found);
+}
+
+/**
+ * Thread body for a parallel build, inserts every word of its piece
+ * of the input into its own tree.
+ *
+ * @param arg the build_job to work on.
+ *
+ * @return NULL.
+ */
+static void *build_piece(void *arg){
+    struct build_job *job = arg;
+    char *word;
+    wordreader in = wordreader_mem(job->start, job->len);
+    while(wordreader_next(in, &word) != EOF){
+        tree_insert(job->t, word);
+    }
+    wordreader_close(in);
+    return NULL;
+}
+
+/**
+ * Builds a tree from all of stdin using several threads. The input is
+ * split into pieces at word boundaries, each thread builds a tree from
+ * one piece, then the trees are merged in input order so the result
+ * matches a tree built by one thread.
+ *
+ * @param method the type of tree to build.
+ * @param threads the number of threads to use.
+ *
+ * @return the merged tree.
+ */
+static tree build_parallel(tree_t method, int threads){
+    size_t size, pos = 0, end;
+    char *buf = map_stream(stdin, &size);
+    int mapped = (buf != NULL);
+    struct build_job *jobs = emalloc(threads * sizeof jobs[0]);
+    pthread_t *ids = emalloc(threads * sizeof ids[0]);
+    tree result;
+    int i, n = 0;
+
+    if(!mapped){
+        buf = read_stream(stdin, &size);
+    }
+    for(i = 0; i < threads && pos < size; i++){
+        end = next_boundary(buf, size, pos + (size - pos) / (threads - i));
+        jobs[n].start = buf + pos;
+        jobs[n].len = end - pos;
+        jobs[n].t = tree_new(method);
+        if(pthread_create(&ids[n], NULL, build_piece, &jobs[n]) != 0){
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        n++;
+        pos = end;
+    }
+    result = (n > 0) ? NULL : tree_new(method);
+    for(i = 0; i < n; i++){
+        pthread_join(ids[i], NULL);
+        if(result == NULL){
+            result = jobs[i].t;
+        }else{
+            tree_merge(result, jobs[i].t);
+            tree_free(jobs[i].t);
+        }
+    }
+    free(ids);
+    free(jobs);
+    if(mapped){
+        unmap_stream(buf, size);
+    }else{
+        free(buf);
+    }
+    return result;
+}
+
 /**
  * Main method handles the calling of the program with command line arguments.
  *
@@ -38,17 +167,27 @@ void print(char *str, int f){
  * @param argv command line arguments given
  */
 int main(int argc, char **argv){
-    const char *optstring = "c:df:orh";
-    FILE *fp;
-    FILE *tdot;
+    const char *optstring = "Bb:c:def:j:oP:rh";
+    FILE *fp = NULL;
+    FILE *tdot = NULL;
 
     tree t = NULL;
     char option;
     tree_t method = BST;
     int c,d,f,o,unknown;
+    int threads = 1;
+    int tokenizers = 0;
+    int bits_per_key = 0;
+    int eytzinger = 0;
+    char *load_file = NULL;
+    char *save_file = NULL;
+    FILE *image;
     char word[256];
-    char *file;
-    clock_t start,end;
+    char *w;
+    wordreader in;
+    pipeline pin;
+    char *file = NULL;
+    double start,end;
     double timeBuild, timeSearch;
 
     /*initialisation of variables for  the switch operation */
@@ -59,8 +198,26 @@ int main(int argc, char **argv){
     o = 0;
       
     /* decides which cases have been called.*/
-    while ((option = getopt(argc, argv, optstring)) != EOF) {
+    while ((option = getopt_long(argc, argv, optstring, long_options,
+                                 NULL)) != EOF) {
         switch (option) {
+            case 'L':
+                /* use the tree saved in the file instead of reading stdin */
+                load_file = optarg;
+                break;
+            case 'S':
+                /* save the tree to the file once it is built */
+                save_file = optarg;
+                break;
+            case 'B':
+                /*make a B-tree instead of a bst*/
+                method = BTREE;
+                break;
+            case 'b':
+                /* put a Bloom filter of this many bits per key in front
+                   of the tree when checking words */
+                bits_per_key = atoi(optarg);
+                break;
             case 'c':/*-c filename*/
                 /* the file to check against the dictionary*/
                 c = 1;
@@ -70,9 +227,29 @@ int main(int argc, char **argv){
                 /* prints the depth of the tree */
                 d = 1;
                 break;
+            case 'e':
+                /* lay the keys out in BFS order for searching once the
+                   tree is built */
+                eytzinger = 1;
+                break;
+            case 'j':
+                /* build the tree with this many threads */
+                threads = atoi(optarg);
+                if(threads < 1){
+                    threads = 1;
+                }
+                break;
             case 'o':
                 o = 1;
                 break;
+            case 'P':
+                /* read stdin on one thread and tokenize it on this many
+                   while this thread builds the tree */
+                tokenizers = atoi(optarg);
+                if(tokenizers < 1){
+                    tokenizers = 1;
+                }
+                break;
             case 'f':
                 /* output a representation of the tree in dot form to the file
                    'tree-view.dot using output-dot*/
@@ -93,54 +270,113 @@ int main(int argc, char **argv){
                 printf("are read from stdin and added to the tree,");
                 printf(" before being printed out\n");
                 printf("alongside their frequencies to stdout.\n");
+                printf("\n -B\t      Make the tree a B-tree of");
+                printf(" many keys a node\n");
+                printf(" -b BITS      With -c, reject unknown words with");
+                printf(" a Bloom filter\n\t      of BITS bits per key first");
                 printf("\n -c FILENAME  Check spelling of");
                 printf(" words in FILENAME using words\n");
                 printf("\t      read from stdin as dictionary. Print timing");
                 printf("\n\t      info & unknown words to stderr");
                 printf(" (ignore -d & -o)\n");
                 printf(" -d\t      Only print the tree depth (ignore -o)");
+                printf("\n -e\t      Search a copy of the keys laid out in");
+                printf(" BFS order");
                 printf("\n -f FILENAME  Write DOT output to FILENAME");
                 printf(" (if -o given)\n");
+                printf(" -j THREADS   Build the tree from stdin using");
+                printf(" THREADS threads\n\t      (and check FILENAME with");
+                printf(" them)\n");
                 printf(" -o\t      Output the tree int DOT form to file");
                 printf("'tree-view.dot'\n");
+                printf(" -P THREADS   Read stdin on one thread, tokenize");
+                printf(" it on THREADS\n\t      and build the tree as");
+                printf(" words arrive (not with -j)\n");
                 printf(" -r\t      Make the tree an RBT");
                 printf(" (BST is the default)\n");
                 printf("\n -h \t      Display this message\n");
+                printf("\n --load FILE  Use the tree saved in FILE instead");
+                printf(" of reading stdin\n");
+                printf(" --save FILE  Save the tree to FILE once it is");
+                printf(" built\n");
                 
                 return EXIT_SUCCESS;
         }
     }
-    
-    t = tree_new(method);       /* Initialises a new tree */
-    start = clock();            /* Starts the clock for tree insert */
-    /* Inserts the words in to the tree and colours the root black */
-    while(getword(word, sizeof word, stdin) != EOF){
-        t = tree_insert(t, word);
-        blackener(t);
+    if(tokenizers > 0 && threads > 1){
+        fprintf(stderr, "-P cannot be used with -j\n");
+        return EXIT_FAILURE;
+    }
+    start = wall_time();        /* Starts the clock for tree insert */
+    if(load_file != NULL){
+        image = fopen(load_file, "rb");
+        if(image == NULL){
+            perror(load_file);
+            return EXIT_FAILURE;
+        }
+        t = tree_load(image);
+        fclose(image);
+        if(t == NULL){
+            fprintf(stderr, "%s: not a saved tree\n", load_file);
+            return EXIT_FAILURE;
+        }
+    }else if(threads > 1){
+        t = build_parallel(method, threads);
+    }else if(tokenizers > 0){
+        t = tree_new(method);
+        pin = pipeline_open(stdin, tokenizers);
+        while(pipeline_next(pin, &w) != EOF){
+            t = tree_insert(t, w);
+        }
+        pipeline_close(pin);
+    }else{
+        t = tree_new(method);   /* Initialises a new tree */
+        /* Inserts the words in to the tree */
+        in = wordreader_open(stdin);
+        while(wordreader_next(in, &w) != EOF){
+            t = tree_insert(t, w);
+        }
+        wordreader_close(in);
+    }
+    if(c == 1 && bits_per_key > 0){
+        filter = bloom_new(tree_num_keys(t), bits_per_key);
+        tree_inorder(t, add_to_filter);
+    }
+    if(eytzinger && !tree_freeze(t)){
+        fprintf(stderr, "keys too long to lay out, searching the tree\n");
+    }
+    end = wall_time();          /*  Stops the clock */
+    timeBuild = end-start;      /* calculates time taken */
+    if(save_file != NULL){
+        image = fopen(save_file, "wb");
+        if(image == NULL || !tree_save(t, image)){
+            perror(save_file);
+            return EXIT_FAILURE;
+        }
+        fclose(image);
     }
-    end = clock();              /*  Stops the clock */
-    timeBuild = (end-start)/(double)CLOCKS_PER_SEC; /* calculates time taken */
 
     /* c case enabled */
     if(c ==1){
-        unknown = 0;
-        start = clock();        /* Starts the clock */
+        start = wall_time();    /* Starts the clock */
         /* searches for words in the dictionary */
-        while(getword(word, sizeof word, fp) != EOF){
-            /* if word not found */
-            if(tree_search(t,word) == 0){
-                printf("%s\n",word);
-                unknown++;
-            }
-        }
-        end = clock();          /* ends the clock */
+        /* the tree is only read from now, so the words can be
+           checked on all -j threads */
+        unknown = check_words(fp, threads, lookup_words, t, stdout);
+        end = wall_time();      /* ends the clock */
         /* calculate time taken */
-        timeSearch = (end-start)/(double)CLOCKS_PER_SEC;
+        timeSearch = end-start;
         
         /* print out stats for fill and search */
         printf("%s\t%s%f\n","Fill time",": ",timeBuild);
         printf("%s\t%s%f\n","Search time",": ",timeSearch);
         printf("%s\t%s%d\n","unknown words","= ",unknown);
+        if(filter != NULL){
+            printf("%s\t%s%d bits/key, %.2f%% false positives\n",
+                   "Bloom filter",": ",bits_per_key,
+                   bloom_false_positives(filter));
+            bloom_free(filter);
+        }
 
         /* close the file stream */
         fclose(fp);
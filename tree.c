@@ -1,13 +1,13 @@
 /********************************************************\           
- * tree.c --   tree program to build a Red Black Tree or*
- *             Binary Search Tree from inputs given by  *
- *             tree-main                                *
+ * tree.c --   tree program to build a Red Black Tree,  *
+ *             Binary Search Tree or B-tree from inputs *
+ *             given by tree-main                       *
  *                                                      *   
  * Authors:    James Douglas, Paul Souter,              *
  *             Ryan Swanepoel                           *   
  *                                                      *   
- * Purpose:    To build a Red Black Tree or Binary      *
- *             Search Tree                              *
+ * Purpose:    To build a Red Black Tree, Binary Search *
+ *             Tree or B-tree                           *
  *                                                      *
 \********************************************************/
 
@@ -15,56 +15,585 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+#include <stdint.h>
 #include "mylib.h"
 #include "tree.h"
 
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) 0)
+#endif
+
+/* a BTREE node that is not the root holds between BTREE_ORDER - 1
+   and BTREE_MAX keys, so its key prefixes span four cache lines */
+#define BTREE_ORDER 16
+#define BTREE_MAX (2 * BTREE_ORDER - 1)
+#define BNODES_PER_SLAB 64
+
 typedef enum { RED, BLACK } tree_colour;
-static tree_t tree_type; 
+typedef struct tree_node *node;
+typedef struct btree_node *bnode;
+
+/* keys shorter than KEY_INLINE bytes are kept in their node, padded
+   with '\0's, so that comparing one is two word compares rather than
+   a trip to the key arena. Longer keys are kept out of line */
+#define KEY_INLINE 16
+#define KEY_SPILLED 0xFF
 
 struct tree_node {
-    char *key;
-    tree_colour colour;
-    tree left;
-    tree right;
+    union {
+        char text[KEY_INLINE];
+        char *spill;
+    } key;
+    node left;
+    node right;
     int frequency;
+    tree_colour colour;
+    unsigned char len;/*length of an inline key, KEY_SPILLED if not*/
+};
+
+/* a key being searched for, packed the way nodes keep keys inline */
+struct packed_key {
+    uint64_t word[2];/*its bytes as numbers that order as the bytes do*/
+    int spilled;/*set if it is too long to be kept inline*/
+};
+
+/* a node of a BTREE: up to BTREE_MAX keys in order, each with the
+   first PREFIX_LEN bytes of it as a number so that most comparisons
+   stay inside the node, and one more child than keys unless a leaf */
+struct btree_node {
+    int count;
+    int leaf;
+    uint64_t prefix[BTREE_MAX];
+    char *key[BTREE_MAX];
+    int frequency[BTREE_MAX];
+    bnode child[BTREE_MAX + 1];
+};
+
+struct treerec {
+    node root;
+    bnode broot;/*the root of a BTREE, whose root is always NULL*/
+    tree_t type;
+    arena keys;/*where the keys of the tree are copied to*/
+    arena nodes;/*pool the nodes of the tree are allocated from*/
+    int num_keys;/*number of different keys*/
+    int num_words;/*number of keys inserted, counting repeats*/
+    struct image_key *frozen;/*sorted keys of a loaded tree, until thawed*/
+    int frozen_root;
+    char *image;/*the snapshot loaded by tree_load, which keys point into*/
+    size_t image_size;
+    int image_mapped;
+    struct eytz_slot *eytz;/*the keys in BFS order once tree_freeze is used*/
+    void *eytz_mem;/*what was allocated for eytz*/
+    char *eytz_keys;/*the text of those keys, one after another*/
+};
+
+/* a key of a tree laid out by tree_freeze. The first PREFIX_LEN bytes
+   of the key are kept here as a number that orders the same way the
+   keys do, so most steps of a search never look at the key itself */
+struct eytz_slot {
+    uint64_t prefix;
+    uint32_t key;/*offset of the key in eytz_keys*/
+    int32_t frequency;
+};
+
+/* the start of a tree saved by tree_save. Its keys follow in order,
+   then the text of the keys, each ended by a '\0' */
+struct image_header {
+    char magic[8];
+    uint32_t byte_order;/*IMAGE_ORDER as written by the saving machine*/
+    uint32_t type;
+    uint32_t num_keys;
+    uint32_t num_words;
+    int32_t root;/*the position of the root key, -1 if there is none*/
+    uint32_t keys_size;
 };
 
+/* a node as saved: its key as an offset into the saved text of the
+   keys, its children as the positions of their keys, or -1. A BTREE
+   node is saved as its keys, each linked to the child before it by
+   left and to the next key of the node by right, but for the last,
+   whose right is the last child and whose colour is 1. A child is
+   given by the position of its first key */
+struct image_key {
+    uint32_t key;
+    int32_t frequency;
+    int32_t left;
+    int32_t right;
+    uint32_t colour;
+};
+
+#define IMAGE_MAGIC "TREE1"
+#define IMAGE_ORDER 0x01020304u
+
+#define NODES_PER_SLAB 1024
+/* an RBT of n nodes is never deeper than 2*log2(n+1) */
+#define MAX_RBT_DEPTH 128
+
+/* number of searches tree_search_batch takes down the tree together */
+#define SEARCH_BATCH 16
+
+#define PREFIX_LEN 8
+#define CACHE_LINE 64
+/* an Eytzinger search prefetches the slots this many levels ahead,
+   which with 16 byte slots fill exactly one cache line */
+#define EYTZ_AHEAD 2
+
 #define IS_BLACK(x) ((NULL == (x)) || (BLACK == (x)->colour))
 #define IS_RED(x) ((NULL != (x)) && (RED == (x)->colour))
 
 /**
- * colours the given node BLACK
+ * colours the root of the given tree BLACK
  *
- * @param t the node to colour BLACK
+ * @param t the tree whose root to colour BLACK
  */
 void blackener(tree t){
-    if(t!=NULL && tree_type == RBT){
-        t->colour = BLACK;
+    if(t!=NULL && t->root != NULL && t->type == RBT){
+        t->root->colour = BLACK;
     }
 }
 
 /**
- * create a new tree
- * allocate memory space for the root
- * set children and key NULL
- * set frequency 0
- * set the type of the tree to the given parameter 
+ * create a new, empty tree
+ * the type of the tree, its node pool, key arena and counters all
+ * belong to the tree, so trees of different types can be used at once
  * 
- * @param tree_type_given the type of tree either BST or RBT
+ * @param type the type of tree, BST, RBT or BTREE
  *
- * @return a new single node.
+ * @return result the new tree.
  */
 tree tree_new(tree_t type){
-    tree result = emalloc( sizeof *result);
+    tree result = emalloc(sizeof *result);
+    result->root = NULL;
+    result->broot = NULL;
+    result->type = type;
+    result->keys = arena_new(0);
+    if(type == BTREE)
+        result->nodes = arena_new(BNODES_PER_SLAB * sizeof (struct btree_node));
+    else
+        result->nodes = arena_new(NODES_PER_SLAB * sizeof (struct tree_node));
+    result->num_keys = 0;
+    result->num_words = 0;
+    result->frozen = NULL;
+    result->frozen_root = -1;
+    result->eytz = NULL;
+    result->eytz_mem = NULL;
+    result->eytz_keys = NULL;
+    result->image = NULL;
+    result->image_size = 0;
+    result->image_mapped = 0;
+    return result;
+}
+
+/**
+ * the key of a node, wherever it is kept
+ *
+ * @param n the node
+ *
+ * @return the key
+ */
+static char *node_key(node n){
+    return (n->len == KEY_SPILLED) ? n->key.spill : n->key.text;
+}
+
+/**
+ * give a node its key, inline if it is short enough
+ *
+ * @param t the tree the node belongs to
+ * @param n the node
+ * @param str the key
+ * @param copy whether to copy a long key into the key arena, or
+ * point at str, which must outlive the tree
+ */
+static void node_set_key(tree t, node n, char *str, int copy){
+    size_t len = strlen(str);
+    if(len < KEY_INLINE){
+        memset(n->key.text, 0, KEY_INLINE);
+        memcpy(n->key.text, str, len);
+        n->len = (unsigned char) len;
+    }else{
+        n->key.spill = copy ? arena_strdup(t->keys, str) : str;
+        n->len = KEY_SPILLED;
+    }
+}
+
+/**
+ * read 8 bytes of an inline key as a number, first byte highest, so
+ * that comparing the numbers compares the bytes as strcmp would
+ *
+ * @param p the bytes
+ *
+ * @return the number
+ */
+static uint64_t key_word(const char *p){
+    uint64_t w = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&w, p, sizeof w);
+    w = __builtin_bswap64(w);
+#else
+    int i;
+    for(i = 0; i < 8; i++)
+        w = (w << 8) | (unsigned char) p[i];
+#endif
+    return w;
+}
+
+/**
+ * pack a key to be searched for the way nodes keep keys inline
+ *
+ * @param str the key
+ * @param k set to the packed key
+ */
+static void key_pack(const char *str, struct packed_key *k){
+    char text[KEY_INLINE];
+    size_t len = strlen(str);
+    k->spilled = (len >= KEY_INLINE);
+    if(!k->spilled){
+        memset(text, 0, KEY_INLINE);
+        memcpy(text, str, len);
+        k->word[0] = key_word(text);
+        k->word[1] = key_word(text + 8);
+    }
+}
+
+/**
+ * compare the key of a node with a key being searched for, a word at
+ * a time when both are short enough to be kept inline
+ *
+ * @param n the node
+ * @param str the key
+ * @param k str packed by key_pack
+ *
+ * @return less than, equal to or greater than 0 as the node's key is
+ * less than, equal to or greater than str
+ */
+static int node_compare(node n, const char *str, const struct packed_key *k){
+    uint64_t w;
+    if(n->len == KEY_SPILLED || k->spilled)
+        return strcmp(node_key(n), str);
+    w = key_word(n->key.text);
+    if(w != k->word[0])
+        return (w < k->word[0]) ? -1 : 1;
+    w = key_word(n->key.text + 8);
+    if(w != k->word[1])
+        return (w < k->word[1]) ? -1 : 1;
+    return 0;
+}
+
+/**
+ * allocate a node with the given key from the tree's node pool
+ * set children NULL
+ * set frequency 0
+ * 
+ * @param t the tree the node belongs to
+ * @param str the key of the node, copied into the node or the tree's
+ * key arena
+ *
+ * @return result a new single node.
+ */
+static node node_new(tree t, char *str){
+    node result = arena_alloc(t->nodes, sizeof *result);
     result->left = NULL;
     result->right = NULL;
-    result->key = NULL;
+    node_set_key(t, result, str, 1);
     result->frequency = 0;
-    result->colour = BLACK;
-    tree_type = type;
+    result->colour = (t->type == RBT) ? RED : BLACK;
+    t->num_keys++;
     return result;
 }
 
+/**
+ * the first PREFIX_LEN bytes of a key as a number, first byte highest
+ * and padded with zero bytes, so comparing the numbers of two keys
+ * gives the same order as strcmp until the numbers are equal
+ *
+ * @param str the key
+ *
+ * @return the prefix of the key
+ */
+static uint64_t key_prefix(const char *str){
+    uint64_t result = 0;
+    int i;
+    for(i = 0; i < PREFIX_LEN; i++){
+        result <<= 8;
+        if(*str != '\0')
+            result |= (unsigned char) *str++;
+    }
+    return result;
+}
+
+/**
+ * compare two keys by their prefixes, looking at the rest of the keys
+ * only if their prefixes are the same
+ *
+ * @param a_prefix the prefix of a
+ * @param a the first key
+ * @param b_prefix the prefix of b
+ * @param b the second key
+ *
+ * @return less than, equal to or greater than 0 as a is less than,
+ * equal to or greater than b
+ */
+static int prefix_compare(uint64_t a_prefix, const char *a,
+                          uint64_t b_prefix, const char *b){
+    if(a_prefix != b_prefix)
+        return (a_prefix < b_prefix) ? -1 : 1;
+    /* a zero byte in the prefix means both keys have ended */
+    if((a_prefix & 0xFF) == 0)
+        return 0;
+    return strcmp(a + PREFIX_LEN, b + PREFIX_LEN);
+}
+
+/**
+ * the key of a frozen tree at the given position in order
+ *
+ * @param t the frozen tree
+ * @param i the position of the key
+ *
+ * @return the key
+ */
+static char *frozen_key(tree t, int i){
+    return (char *) (t->frozen + t->num_keys) + t->frozen[i].key;
+}
+
+/**
+ * drop the Eytzinger layout of a tree, if it has one, once the tree
+ * is about to change
+ *
+ * @param t the tree
+ */
+static void eytz_free(tree t){
+    free(t->eytz_mem);
+    free(t->eytz_keys);
+    t->eytz = NULL;
+    t->eytz_mem = NULL;
+    t->eytz_keys = NULL;
+}
+
+/**
+ * allocate an empty BTREE node from the tree's node pool
+ *
+ * @param t the tree the node belongs to
+ * @param leaf whether the node is a leaf
+ *
+ * @return result the new node
+ */
+static bnode bnode_new(tree t, int leaf){
+    bnode result = arena_alloc(t->nodes, sizeof *result);
+    result->count = 0;
+    result->leaf = leaf;
+    return result;
+}
+
+/**
+ * move some keys of a BTREE node, with their prefixes and
+ * frequencies, to another node or another place in the same node
+ *
+ * @param to the node to move the keys to
+ * @param at where in to the first key goes
+ * @param from the node to move the keys from
+ * @param start the first key of from to move
+ * @param n the number of keys to move
+ */
+static void bnode_move(bnode to, int at, bnode from, int start, int n){
+    memmove(to->prefix + at, from->prefix + start, n * sizeof to->prefix[0]);
+    memmove(to->key + at, from->key + start, n * sizeof to->key[0]);
+    memmove(to->frequency + at, from->frequency + start,
+            n * sizeof to->frequency[0]);
+}
+
+/**
+ * binary search the keys of a BTREE node for the first one not less
+ * than str, comparing prefixes inside the node first
+ *
+ * @param n the node
+ * @param str the key
+ * @param prefix the prefix of str
+ *
+ * @return the position of that key, n->count if every key is less,
+ * which is also the child to go down to when it is not str
+ */
+static int bnode_position(bnode n, const char *str, uint64_t prefix){
+    int lo = 0, hi = n->count, mid;
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if(prefix_compare(n->prefix[mid], n->key[mid], prefix, str) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * find a key of a BTREE
+ *
+ * @param t the tree
+ * @param str the key to find
+ * @param prefix the prefix of str
+ *
+ * @return the frequency of the key, to be read or changed, or NULL if
+ * the key is not in the tree
+ */
+static int *btree_find(tree t, const char *str, uint64_t prefix){
+    bnode n = t->broot;
+    int i;
+    while(n != NULL){
+        i = bnode_position(n, str, prefix);
+        if(i < n->count && prefix_compare(n->prefix[i], n->key[i],
+                                          prefix, str) == 0)
+            return &n->frequency[i];
+        n = n->leaf ? NULL : n->child[i];
+    }
+    return NULL;
+}
+
+/**
+ * split the full child i of a BTREE node in two around its middle key,
+ * which moves up into the node
+ *
+ * @param t the tree
+ * @param parent the node, which must not be full
+ * @param i the child to split
+ */
+static void bnode_split(tree t, bnode parent, int i){
+    bnode left = parent->child[i];
+    bnode right = bnode_new(t, left->leaf);
+    bnode_move(right, 0, left, BTREE_ORDER, BTREE_ORDER - 1);
+    if(!left->leaf)
+        memcpy(right->child, left->child + BTREE_ORDER,
+               BTREE_ORDER * sizeof right->child[0]);
+    right->count = BTREE_ORDER - 1;
+    left->count = BTREE_ORDER - 1;
+    memmove(parent->child + i + 2, parent->child + i + 1,
+            (parent->count - i) * sizeof parent->child[0]);
+    parent->child[i + 1] = right;
+    bnode_move(parent, i + 1, parent, i, parent->count - i);
+    bnode_move(parent, i, left, BTREE_ORDER - 1, 1);
+    parent->count++;
+}
+
+/**
+ * insert a key into a BTREE, or add to its frequency if it is there.
+ * A new key goes down from the root in one pass, splitting every full
+ * node on the way so that the leaf it ends in has room for it.
+ *
+ * @param t the tree to add to
+ * @param str the key, copied into the tree's key arena if it is new
+ * @param count how many times str is being added
+ */
+static void btree_insert_count(tree t, char *str, int count){
+    uint64_t prefix = key_prefix(str);
+    int *frequency = btree_find(t, str, prefix);
+    bnode n;
+    int i;
+    if(frequency != NULL){
+        *frequency += count;
+        return;
+    }
+    if(t->broot == NULL)
+        t->broot = bnode_new(t, 1);
+    if(t->broot->count == BTREE_MAX){
+        n = bnode_new(t, 0);
+        n->child[0] = t->broot;
+        bnode_split(t, n, 0);
+        t->broot = n;
+    }
+    n = t->broot;
+    i = bnode_position(n, str, prefix);
+    while(!n->leaf){
+        if(n->child[i]->count == BTREE_MAX){
+            bnode_split(t, n, i);
+            if(prefix_compare(n->prefix[i], n->key[i], prefix, str) < 0)
+                i++;
+        }
+        n = n->child[i];
+        i = bnode_position(n, str, prefix);
+    }
+    bnode_move(n, i + 1, n, i, n->count - i);
+    n->prefix[i] = prefix;
+    n->key[i] = arena_strdup(t->keys, str);
+    n->frequency[i] = count;
+    n->count++;
+    t->num_keys++;
+}
+
+/**
+ * turn a saved BTREE node and those below it back into nodes
+ *
+ * @param t the tree being thawed
+ * @param keys its keys in order, copied into its key arena
+ * @param first the position of the node's first key
+ *
+ * @return the node
+ */
+static bnode btree_thaw_node(tree t, char **keys, int first){
+    struct image_key *k = &t->frozen[first];
+    bnode n = bnode_new(t, k->left < 0);
+    int i = first;
+    for(;;){
+        k = &t->frozen[i];
+        n->prefix[n->count] = key_prefix(keys[i]);
+        n->key[n->count] = keys[i];
+        n->frequency[n->count] = k->frequency;
+        if(!n->leaf)
+            n->child[n->count] = btree_thaw_node(t, keys, k->left);
+        n->count++;
+        if(k->colour)
+            break;
+        i = k->right;
+    }
+    if(!n->leaf)
+        n->child[n->count] = btree_thaw_node(t, keys, k->right);
+    return n;
+}
+
+/**
+ * turn a tree loaded by tree_load back into nodes, in the shape it
+ * was saved in, so it can be changed or walked like any other. Its
+ * short keys are copied into the nodes and the rest stay in the image,
+ * but for a BTREE, whose keys are copied into its key arena in order
+ * so that merging it visits them.
+ *
+ * @param t the tree to thaw, which does nothing if it is not frozen
+ */
+static void tree_thaw(tree t){
+    node *nodes;
+    char **keys;
+    struct image_key *k;
+    int i;
+    if(t->frozen == NULL)
+        return;
+    if(t->type == BTREE){
+        keys = emalloc((t->num_keys + 1) * sizeof keys[0]);
+        for(i = 0; i < t->num_keys; i++)
+            keys[i] = arena_strdup(t->keys, frozen_key(t, i));
+        if(t->frozen_root >= 0)
+            t->broot = btree_thaw_node(t, keys, t->frozen_root);
+        t->frozen = NULL;
+        free(keys);
+        return;
+    }
+    nodes = emalloc((t->num_keys + 1) * sizeof nodes[0]);
+    for(i = 0; i < t->num_keys; i++){
+        nodes[i] = arena_alloc(t->nodes, sizeof *nodes[i]);
+        node_set_key(t, nodes[i], frozen_key(t, i), 0);
+    }
+    for(i = 0; i < t->num_keys; i++){
+        k = &t->frozen[i];
+        nodes[i]->frequency = k->frequency;
+        nodes[i]->colour = k->colour ? RED : BLACK;
+        nodes[i]->left = (k->left < 0) ? NULL : nodes[k->left];
+        nodes[i]->right = (k->right < 0) ? NULL : nodes[k->right];
+    }
+    t->root = (t->frozen_root < 0) ? NULL : nodes[t->frozen_root];
+    t->frozen = NULL;
+    free(nodes);
+}
+
 /**
  * rotate the tree to the left
  * right child of the root node becomes the root
@@ -75,8 +604,8 @@ tree tree_new(tree_t type){
  *
  * @return temp the new root of the tree
  */
-static tree rotate_left(tree t){
-    tree temp = t->right;
+static node rotate_left(node t){
+    node temp = t->right;
     t->right = temp->left;
     temp->left = t;
     return temp;
@@ -93,8 +622,8 @@ static tree rotate_left(tree t){
  * @return temp the new root of the tree
  */
 
-static tree rotate_right(tree t){
-    tree temp = t->left;
+static node rotate_right(node t){
+    node temp = t->left;
     t->left= temp->right;
     temp->right = t;
     return temp;
@@ -109,7 +638,7 @@ static tree rotate_right(tree t){
  *
  * @return t the fixed RBT 
  */
-static tree tree_fix(tree t){
+static node tree_fix(node t){
     if(IS_RED(t->left) && t->left != NULL){
         if(IS_RED(t->left->left)&& IS_RED(t->right)){
             t->left->colour = BLACK;
@@ -166,6 +695,57 @@ static tree tree_fix(tree t){
     }
     return t;
 } 
+/**
+ * insert an item into the tree, or add to its frequency
+ * if the key already exists in the tree add count to its frequency
+ * otherwise add it to the tree, then fix the tree if its an RBT tree.
+ * The insert walks down the tree in a loop, remembering the links it
+ * followed for an RBT, then fixes upwards from the new node only until
+ * a fixed subtree has a black root, since nothing above it can change.
+ * @param t the tree to add to
+ * @param str the key to try add
+ * @param count how many times str is being added
+ */
+static void tree_insert_count(tree t, char *str, int count){
+    node *path[MAX_RBT_DEPTH];
+    node *link = &t->root;
+    struct packed_key k;
+    int depth = 0;
+    int cmp;
+    tree_thaw(t);
+    eytz_free(t);
+    t->num_words += count;
+    if(t->type == BTREE){
+        btree_insert_count(t, str, count);
+        return;
+    }
+    key_pack(str, &k);
+    while(*link != NULL){
+        cmp = node_compare(*link, str, &k);
+        if(cmp == 0){
+            (*link)->frequency += count;
+            return;
+        }
+        if(t->type == RBT){
+            assert(depth < MAX_RBT_DEPTH);
+            path[depth++] = link;
+        }
+        link = (cmp > 0) ? &(*link)->left : &(*link)->right;
+    }
+    *link = node_new(t, str);
+    (*link)->frequency = count;
+    if(t->type == RBT){
+        while(depth > 0){
+            link = path[--depth];
+            *link = tree_fix(*link);
+            if(IS_BLACK(*link)){
+                break;
+            }
+        }
+        blackener(t);
+    }
+}
+
 /**
  * insert an item into the tree
  * if the key already exists in the tree increment frequency
@@ -176,29 +756,186 @@ static tree tree_fix(tree t){
  * @return t the tree after changes
  */
 tree tree_insert(tree t, char *str){ 
-    int cmp;
-    if(t ==NULL){
-        t = tree_new(tree_type);
+    tree_insert_count(t, str, 1);
+    return t;
+}
+
+/**
+ * arena_walk callback for tree_merge, adds one node of the source
+ * tree to the destination tree
+ *
+ * @param obj the node to add
+ * @param arg the tree to add it to
+ */
+static void merge_node(void *obj, void *arg){
+    node n = obj;
+    tree_insert_count(arg, node_key(n), n->frequency);
+}
+
+/* the trees tree_merge is merging a BTREE between */
+struct merge_pair {
+    tree dst;
+    tree src;
+};
+
+/**
+ * arena_walk_strings callback for tree_merge, adds one key of a
+ * source BTREE to the destination tree
+ *
+ * @param str the key to add
+ * @param arg the merge_pair
+ */
+static void merge_key(char *str, void *arg){
+    struct merge_pair *pair = arg;
+    tree_insert_count(pair->dst, str,
+                      *btree_find(pair->src, str, key_prefix(str)));
+}
+
+/**
+ * Adds every key of src to dst along with its frequency. The keys
+ * are visited in the order src first saw them, which is the order
+ * its node pool holds them in, or its key arena for a BTREE, whose
+ * nodes hold many keys, so merging the trees built from consecutive
+ * pieces of the input gives dst the same shape as a tree built from
+ * the whole input.
+ *
+ * @param dst the tree to merge into
+ * @param src the tree to merge from, left unchanged
+ */
+void tree_merge(tree dst, tree src){
+    struct merge_pair pair;
+    tree_thaw(src);
+    if(src->type == BTREE){
+        pair.dst = dst;
+        pair.src = src;
+        arena_walk_strings(src->keys, merge_key, &pair);
+        return;
     }
-    if(t->key == NULL){
-        t->key = emalloc(strlen(str)+1 * sizeof t-> key[0]);
-        strcpy(t->key, str);
-        if(tree_type == RBT){
-            t->colour = RED;
-        }
+    arena_walk(src->nodes, sizeof (struct tree_node), merge_node, dst);
+}
+
+/**
+ * compare a key to the key of an Eytzinger slot, looking at the rest
+ * of the keys only if their prefixes are the same
+ *
+ * @param t the tree, laid out by tree_freeze
+ * @param slot the slot to compare with
+ * @param str the key
+ * @param prefix the prefix of str
+ *
+ * @return less than, equal to or greater than 0 as the slot's key is
+ * less than, equal to or greater than str
+ */
+static int eytz_compare(tree t, const struct eytz_slot *slot,
+                        const char *str, uint64_t prefix){
+    return prefix_compare(slot->prefix, t->eytz_keys + slot->key,
+                          prefix, str);
+}
+
+/**
+ * turn where an Eytzinger descent fell off the bottom of the tree into
+ * the slot of the smallest key not less than the one searched for,
+ * by undoing the right turns made after the last left turn
+ *
+ * @param k the position past the bottom
+ *
+ * @return the slot, 0 if every key is less than the one searched for
+ */
+static unsigned long eytz_lower_bound(unsigned long k){
+#if defined(__GNUC__)
+    return k >> __builtin_ffsl((long) ~k);
+#else
+    while(k & 1)
+        k >>= 1;
+    return k >> 1;
+#endif
+}
+
+/**
+ * search the Eytzinger layout of a tree for the given str. The
+ * descent only decides which way to go at each level, with no branch
+ * on the outcome, and prefetches the slots EYTZ_AHEAD levels below
+ *
+ * @param t the tree to search, laid out by tree_freeze
+ * @param str the key to find
+ *
+ * @return result 0 if not found, 1 if found
+ */
+static int eytz_search(tree t, char *str){
+    uint64_t prefix = key_prefix(str);
+    unsigned long n = t->num_keys;
+    unsigned long k = 1;
+    while(k <= n){
+        PREFETCH(t->eytz + (k << EYTZ_AHEAD));
+        k = 2 * k + (eytz_compare(t, &t->eytz[k], str, prefix) < 0);
     }
-    cmp = strcmp(t-> key, str);
-    if(cmp == 0){
-        t->frequency++;
-    }else if(cmp > 0){
-        t->left = tree_insert(t->left, str);
-    }else if(cmp< 0){
-        t->right = tree_insert(t-> right, str);
+    k = eytz_lower_bound(k);
+    return k != 0 && eytz_compare(t, &t->eytz[k], str, prefix) == 0;
+}
+
+/**
+ * search the Eytzinger layout of a tree for several keys,
+ * taking SEARCH_BATCH of them down the levels together
+ *
+ * @param t the tree to search, laid out by tree_freeze
+ * @param words the keys to find
+ * @param n the number of keys
+ * @param results set to 1 for each key that is found, 0 if not
+ */
+static void eytz_search_batch(tree t, char **words, int n, int *results){
+    uint64_t prefix[SEARCH_BATCH];
+    unsigned long k[SEARCH_BATCH];
+    unsigned long size = t->num_keys;
+    int i, j, m, active;
+    for(i = 0; i < n; i += m){
+        m = (n - i < SEARCH_BATCH) ? n - i : SEARCH_BATCH;
+        for(j = 0; j < m; j++){
+            prefix[j] = key_prefix(words[i + j]);
+            k[j] = 1;
+        }
+        active = (size > 0);
+        while(active){
+            active = 0;
+            for(j = 0; j < m; j++){
+                if(k[j] <= size){
+                    PREFETCH(t->eytz + (k[j] << EYTZ_AHEAD));
+                    k[j] = 2 * k[j] + (eytz_compare(t, &t->eytz[k[j]],
+                                                    words[i + j],
+                                                    prefix[j]) < 0);
+                    active |= (k[j] <= size);
+                }
+            }
+        }
+        for(j = 0; j < m; j++){
+            k[j] = eytz_lower_bound(k[j]);
+            results[i + j] = k[j] != 0 &&
+                eytz_compare(t, &t->eytz[k[j]], words[i + j],
+                             prefix[j]) == 0;
+        }
     }
-    if(tree_type == RBT){
-        t = tree_fix(t);
+}
+
+/**
+ * binary search the sorted keys of a frozen tree for the given str
+ *
+ * @param t the frozen tree to search
+ * @param str the key to find
+ *
+ * @return result 0 if not found, 1 if found
+ */
+static int frozen_search(tree t, char *str){
+    int lo = 0, hi = t->num_keys, mid, cmp;
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(frozen_key(t, mid), str);
+        if(cmp == 0)
+            return 1;
+        if(cmp > 0)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
-    return t;
+    return 0;
 }
 
 /**
@@ -210,18 +947,286 @@ tree tree_insert(tree t, char *str){
  * @return result 0 if not found, 1 if found
  */
 int tree_search(tree t, char *str){
-    int result=0;
+    node n = t->root;
+    struct packed_key k;
     int cmp;
-    if(t == NULL)
-        return result;
-    cmp = strcmp(t-> key, str);
-    if(cmp == 0)
-        result++;
-    if(cmp>0)
-        result = tree_search(t->left, str);
-    if(cmp<0)
-        result = tree_search(t->right, str);
-    return result;
+    if(t->eytz != NULL)
+        return eytz_search(t, str);
+    if(t->frozen != NULL)
+        return frozen_search(t, str);
+    if(t->type == BTREE)
+        return btree_find(t, str, key_prefix(str)) != NULL;
+    key_pack(str, &k);
+    while(n != NULL){
+        cmp = node_compare(n, str, &k);
+        if(cmp == 0)
+            return 1;
+        n = (cmp > 0) ? n->left : n->right;
+    }
+    return 0;
+}
+
+/**
+ * search a BTREE for several keys, taking SEARCH_BATCH of them down
+ * the levels together. The key prefixes of the nodes they step to
+ * are prefetched before any of them is searched, so that their cache
+ * misses overlap.
+ *
+ * @param t the tree to search
+ * @param words the keys to find
+ * @param n the number of keys
+ * @param results set to 1 for each key that is found, 0 if not
+ */
+static void btree_search_batch(tree t, char **words, int n, int *results){
+    uint64_t prefix[SEARCH_BATCH];
+    bnode at[SEARCH_BATCH];
+    int i, j, k, m, active;
+    for(i = 0; i < n; i += m){
+        m = (n - i < SEARCH_BATCH) ? n - i : SEARCH_BATCH;
+        active = 0;
+        for(j = 0; j < m; j++){
+            prefix[j] = key_prefix(words[i + j]);
+            at[j] = t->broot;
+            results[i + j] = 0;
+            if(at[j] != NULL)
+                active++;
+        }
+        while(active > 0){
+            for(j = 0; j < m; j++){
+                if(at[j] != NULL){
+                    PREFETCH(at[j]->prefix + at[j]->count / 2);
+                }
+            }
+            for(j = 0; j < m; j++){
+                if(at[j] == NULL){
+                    continue;
+                }
+                k = bnode_position(at[j], words[i + j], prefix[j]);
+                if(k < at[j]->count
+                   && prefix_compare(at[j]->prefix[k], at[j]->key[k],
+                                     prefix[j], words[i + j]) == 0){
+                    results[i + j] = 1;
+                    at[j] = NULL;
+                }else{
+                    at[j] = at[j]->leaf ? NULL : at[j]->child[k];
+                }
+                if(at[j] == NULL){
+                    active--;
+                }else{
+                    PREFETCH(at[j]);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * search the tree for several keys at once, SEARCH_BATCH at a time.
+ * The searches of a group go down the tree together a level at a
+ * time: the keys of the nodes they have reached are prefetched before
+ * any of them is compared, and the nodes they step to next are
+ * prefetched before the next level, so their cache misses overlap.
+ *
+ * @param t the tree to search
+ * @param words the keys to find
+ * @param n the number of keys
+ * @param results set to 1 for each key that is found, 0 if not
+ */
+void tree_search_batch(tree t, char **words, int n, int *results){
+    node at[SEARCH_BATCH];
+    struct packed_key k[SEARCH_BATCH];
+    int i, j, m, active, cmp;
+    if(t->eytz != NULL){
+        eytz_search_batch(t, words, n, results);
+        return;
+    }
+    if(t->frozen != NULL){
+        for(i = 0; i < n; i++)
+            results[i] = frozen_search(t, words[i]);
+        return;
+    }
+    if(t->type == BTREE){
+        btree_search_batch(t, words, n, results);
+        return;
+    }
+    for(i = 0; i < n; i += m){
+        m = (n - i < SEARCH_BATCH) ? n - i : SEARCH_BATCH;
+        active = 0;
+        for(j = 0; j < m; j++){
+            at[j] = t->root;
+            key_pack(words[i + j], &k[j]);
+            results[i + j] = 0;
+            if(at[j] != NULL){
+                active++;
+            }
+        }
+        while(active > 0){
+            for(j = 0; j < m; j++){
+                if(at[j] != NULL && at[j]->len == KEY_SPILLED){
+                    PREFETCH(at[j]->key.spill);
+                }
+            }
+            for(j = 0; j < m; j++){
+                if(at[j] == NULL){
+                    continue;
+                }
+                cmp = node_compare(at[j], words[i + j], &k[j]);
+                if(cmp == 0){
+                    results[i + j] = 1;
+                    at[j] = NULL;
+                }else{
+                    at[j] = (cmp > 0) ? at[j]->left : at[j]->right;
+                }
+                if(at[j] == NULL){
+                    active--;
+                }else{
+                    PREFETCH(at[j]);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * push a node onto a traversal stack, growing it when it is full
+ *
+ * @param stack the stack, may be moved when it grows
+ * @param size the number of nodes on the stack
+ * @param cap the number of nodes the stack has room for
+ * @param t the node to push
+ */
+static void stack_push(node **stack, int *size, int *cap, node t){
+    if(*size == *cap){
+        *cap = (*cap == 0) ? 64 : 2 * *cap;
+        *stack = erealloc(*stack, *cap * sizeof (*stack)[0]);
+    }
+    (*stack)[(*size)++] = t;
+}
+
+/**
+ * copy the keys of a BTREE subtree and their frequencies out in order.
+ * A BTREE is never more than a few levels deep, so its walks recurse.
+ *
+ * @param n the root of the subtree
+ * @param keys where to put the keys
+ * @param freqs where to put their frequencies
+ * @param next the position the next key goes at
+ */
+static void btree_collect(bnode n, char **keys, int *freqs, int *next){
+    int i;
+    for(i = 0; i <= n->count; i++){
+        if(!n->leaf)
+            btree_collect(n->child[i], keys, freqs, next);
+        if(i < n->count){
+            keys[*next] = n->key[i];
+            freqs[(*next)++] = n->frequency[i];
+        }
+    }
+}
+
+/**
+ * place the keys of a tree, given in order, into their Eytzinger
+ * slots: slot k's children are slots 2k and 2k+1, so filling the
+ * slots in order of an inorder walk of that implicit tree sorts them
+ *
+ * @param t the tree being frozen
+ * @param keys the keys in order
+ * @param freqs their frequencies
+ * @param k the slot to fill the subtree of
+ * @param next the next key in order to place
+ * @param text how much of eytz_keys the keys placed so far take up
+ */
+static void eytz_fill(tree t, char **keys, int *freqs, unsigned long k,
+                      int *next, size_t *text){
+    size_t len;
+    if(k > (unsigned long) t->num_keys)
+        return;
+    eytz_fill(t, keys, freqs, 2 * k, next, text);
+    len = strlen(keys[*next]) + 1;
+    t->eytz[k].prefix = key_prefix(keys[*next]);
+    t->eytz[k].key = (uint32_t) *text;
+    t->eytz[k].frequency = freqs[*next];
+    memcpy(t->eytz_keys + *text, keys[*next], len);
+    *text += len;
+    (*next)++;
+    eytz_fill(t, keys, freqs, 2 * k + 1, next, text);
+}
+
+/**
+ * lay the keys of a tree out for searching only, in Eytzinger order:
+ * the order a walk of the levels of a perfectly balanced tree visits
+ * them in. The slots hold a prefix of each key inline, are aligned so
+ * the four grandchildren of slot k (4k..4k+3) share a cache line, and
+ * the keys are copied into one block. The nodes are kept, so the tree
+ * can still be walked, but an insert drops the layout again.
+ *
+ * @param t the tree to freeze
+ *
+ * @return 1 if the tree was frozen, 0 if its keys are too long in all
+ */
+int tree_freeze(tree t){
+    char **keys = emalloc((t->num_keys + 1) * sizeof keys[0]);
+    int *freqs = emalloc((t->num_keys + 1) * sizeof freqs[0]);
+    node *stack = NULL;
+    node n = t->root;
+    int size = 0, cap = 0, next = 0;
+    size_t text = 0;
+
+    eytz_free(t);
+    if(t->frozen != NULL){
+        for(next = 0; next < t->num_keys; next++){
+            keys[next] = frozen_key(t, next);
+            freqs[next] = t->frozen[next].frequency;
+        }
+    }else if(t->type == BTREE){
+        if(t->broot != NULL)
+            btree_collect(t->broot, keys, freqs, &next);
+    }else{
+        while(n != NULL || size > 0){
+            while(n != NULL){
+                stack_push(&stack, &size, &cap, n);
+                n = n->left;
+            }
+            n = stack[--size];
+            keys[next] = node_key(n);
+            freqs[next++] = n->frequency;
+            n = n->right;
+        }
+        free(stack);
+    }
+    for(next = 0; next < t->num_keys; next++)
+        text += strlen(keys[next]) + 1;
+    if(text > UINT32_MAX){
+        free(keys);
+        free(freqs);
+        return 0;
+    }
+    /* slot 0 is unused, slot 1 is the root */
+    t->eytz_mem = emalloc((t->num_keys + 1) * sizeof t->eytz[0] + CACHE_LINE);
+    t->eytz = (struct eytz_slot *) (((uintptr_t) t->eytz_mem + CACHE_LINE - 1)
+                                    & ~(uintptr_t) (CACHE_LINE - 1));
+    t->eytz_keys = emalloc(text + 1);
+    next = 0;
+    text = 0;
+    eytz_fill(t, keys, freqs, 1, &next, &text);
+    free(keys);
+    free(freqs);
+    return 1;
+}
+
+/**
+ * pre order traversal of a BTREE subtree, calling the function f on
+ * each key of a node before going down to its children
+ *
+ * @param n the root of the subtree
+ * @param f the function to call on each key
+ */
+static void btree_preorder(bnode n, void f(char *str, int f)){
+    int i;
+    for(i = 0; i < n->count; i++)
+        f(n->key[i], n->frequency[i]);
+    for(i = 0; !n->leaf && i <= n->count; i++)
+        btree_preorder(n->child[i], f);
 }
 
 /**
@@ -231,14 +1236,43 @@ int tree_search(tree t, char *str){
  * @param f the function to call on each node
  */
 void tree_preorder(tree t, void f(char *str, int f)){
-    if(t == NULL)
+    node *stack = NULL;
+    node n;
+    int size = 0;
+    int cap = 0;
+    tree_thaw(t);
+    if(t->broot != NULL)
+        btree_preorder(t->broot, f);
+    if(t->root == NULL)
         return;
-    f(t->key, t->frequency);
-    if(t->left != NULL)
-        tree_preorder(t->left, f);
-    if(t->right != NULL)
-        tree_preorder(t->right, f);
+    stack_push(&stack, &size, &cap, t->root);
+    while(size > 0){
+        n = stack[--size];
+        f(node_key(n), n->frequency);
+        if(n->right != NULL)
+            stack_push(&stack, &size, &cap, n->right);
+        if(n->left != NULL)
+            stack_push(&stack, &size, &cap, n->left);
+    }
+    free(stack);
 }
+/**
+ * In order traversal of a BTREE subtree, calling the function f on
+ * each key between going down to the children either side of it
+ *
+ * @param n the root of the subtree
+ * @param f the function to call on each key
+ */
+static void btree_inorder(bnode n, void f(char *str, int f)){
+    int i;
+    for(i = 0; i <= n->count; i++){
+        if(!n->leaf)
+            btree_inorder(n->child[i], f);
+        if(i < n->count)
+            f(n->key[i], n->frequency[i]);
+    }
+}
+
 /**
  * In order traversal of the tree calling the function f on each node
  * 
@@ -246,61 +1280,160 @@ void tree_preorder(tree t, void f(char *str, int f)){
  * @param f the function to call on each node
  */
 void tree_inorder(tree t, void f(char *str, int f)){
-    if(t ==NULL)
+    node *stack = NULL;
+    node n = t->root;
+    int size = 0;
+    int cap = 0;
+    if(t->frozen != NULL){
+        for(size = 0; size < t->num_keys; size++)
+            f(frozen_key(t, size), t->frozen[size].frequency);
         return;
-    if(t->left != NULL)
-        tree_inorder(t->left, f);
-    f(t-> key, t->frequency);
-    if(t->right !=NULL)
-        tree_inorder(t->right, f);
+    }
+    if(t->broot != NULL)
+        btree_inorder(t->broot, f);
+    while(n != NULL || size > 0){
+        while(n != NULL){
+            stack_push(&stack, &size, &cap, n);
+            n = n->left;
+        }
+        n = stack[--size];
+        f(node_key(n), n->frequency);
+        n = n->right;
+    }
+    free(stack);
 }
 
 /**
- * Find the depth of the deepest path of the tree
+ * Find the depth of the deepest path of the tree, going down it one
+ * level at a time so that deep trees cannot run out of stack
  * 
  * @param t the tree to find the depth of
  *
  * @return result int the depth of the deepest node
  */
 int tree_depth(tree t){
-    int result =0;
-    int leftx=0;
-    int rightx= 0;
-    if(t->left !=NULL){
-        leftx = 1 + tree_depth(t->left);
-    }
-    if(t->right !=NULL){
-        rightx = 1 + tree_depth(t->right);
-    }
-    if(rightx < leftx){
-        result += leftx;
+    node *level = NULL;
+    node *next = NULL;
+    node *swap;
+    int size = 0, next_size, cap = 0, next_cap = 0;
+    bnode b;
+    int result = -1;
+    int i;
+    tree_thaw(t);
+    if(t->broot != NULL){
+        /* every leaf of a BTREE is as deep as the others */
+        result = 0;
+        for(b = t->broot; !b->leaf; b = b->child[0])
+            result++;
+        return result;
     }
-    if(leftx <= rightx){
-        result += rightx;
+    if(t->root == NULL)
+        return 0;
+    stack_push(&level, &size, &cap, t->root);
+    while(size > 0){
+        result++;
+        next_size = 0;
+        for(i = 0; i < size; i++){
+            if(level[i]->left != NULL)
+                stack_push(&next, &next_size, &next_cap, level[i]->left);
+            if(level[i]->right != NULL)
+                stack_push(&next, &next_size, &next_cap, level[i]->right);
+        }
+        swap = level; level = next; next = swap;
+        i = cap; cap = next_cap; next_cap = i;
+        size = next_size;
     }
+    free(level);
+    free(next);
     return result;
 }
 
+/**
+ * Gives the number of different keys in the tree.
+ *
+ * @param t the tree to count the keys of
+ *
+ * @return the number of different keys
+ */
+int tree_num_keys(tree t){
+    return t->num_keys;
+}
+
 /**
  * Traverses the tree writing a DOT description about connections, and
- * possibly colours, to the given output stream.
+ * possibly colours, to the given output stream. Each node is described
+ * before its subtrees, and the edge to each child after the child's
+ * subtree. An explicit stack is used, as in tree_preorder, so a
+ * degenerate tree does not run out of call stack.
  *
- * @param t the tree to output a DOT description of.
+ * @param type the type of the tree, BST or RBT.
+ * @param root the node to output a DOT description of.
  * @param out the stream to write the DOT output to.
  */
-static void tree_output_dot_aux(tree t, FILE *out) {
-    if(t->key != NULL) {
-        fprintf(out, "\"%s\"[label=\"{<f0>%s:%d|{<f1>|<f2>}}\"color=%s];\n",
-                t->key, t->key, t->frequency,
-                (RBT == tree_type && RED == t->colour) ? "red":"black");
-    }
-    if(t->left != NULL) {
-        tree_output_dot_aux(t->left, out);
-        fprintf(out, "\"%s\":f1 -> \"%s\":f0;\n", t->key, t->left->key);
+static void tree_output_dot_aux(tree_t type, node root, FILE *out) {
+    node *stack = NULL;
+    int *done = NULL;/*children of each node output, -1 before the node*/
+    int size = 0;
+    int cap = 0;
+    int old_cap;
+    node t, child;
+
+    stack_push(&stack, &size, &cap, root);
+    done = emalloc(cap * sizeof done[0]);
+    done[0] = -1;
+    while(size > 0){
+        t = stack[size - 1];
+        child = NULL;
+        if(done[size - 1] < 0) {
+            if(node_key(t) != NULL) {
+                fprintf(out, "\"%s\"[label=\"{<f0>%s:%d|{<f1>|<f2>}}\"color=%s];\n",
+                        node_key(t), node_key(t), t->frequency,
+                        (RBT == type && RED == t->colour) ? "red":"black");
+            }
+            child = t->left;
+        }else if(done[size - 1] == 0) {
+            if(t->left != NULL)
+                fprintf(out, "\"%s\":f1 -> \"%s\":f0;\n", node_key(t),
+                        node_key(t->left));
+            child = t->right;
+        }else {
+            if(t->right != NULL)
+                fprintf(out, "\"%s\":f2 -> \"%s\":f0;\n", node_key(t),
+                        node_key(t->right));
+            size--;
+            continue;
+        }
+        done[size - 1]++;
+        if(child != NULL) {
+            old_cap = cap;
+            stack_push(&stack, &size, &cap, child);
+            if(cap != old_cap)
+                done = erealloc(done, cap * sizeof done[0]);
+            done[size - 1] = -1;
+        }
     }
-    if(t->right != NULL) {
-        tree_output_dot_aux(t->right, out);
-        fprintf(out, "\"%s\":f2 -> \"%s\":f0;\n", t->key, t->right->key);
+    free(stack);
+    free(done);
+}
+
+/**
+ * Writes a DOT description of a BTREE subtree to the given output
+ * stream, each node as a record of its keys between its children.
+ * A node is named after its first key.
+ *
+ * @param n the root of the subtree.
+ * @param out the stream to write the DOT output to.
+ */
+static void btree_output_dot_aux(bnode n, FILE *out){
+    int i;
+    fprintf(out, "\"%s\"[label=\"", n->key[0]);
+    for(i = 0; i < n->count; i++)
+        fprintf(out, "<c%d>|%s:%d|", i, n->key[i], n->frequency[i]);
+    fprintf(out, "<c%d>\"color=black];\n", n->count);
+    for(i = 0; !n->leaf && i <= n->count; i++){
+        btree_output_dot_aux(n->child[i], out);
+        fprintf(out, "\"%s\":c%d -> \"%s\";\n", n->key[0], i,
+                n->child[i]->key[0]);
     }
 }
 
@@ -317,27 +1450,366 @@ static void tree_output_dot_aux(tree t, FILE *out) {
  * @param out the stream to write the DOT description to.
  */
 void tree_output_dot(tree t, FILE *out) {
+    tree_thaw(t);
     fprintf(out, "digraph tree {\nnode [shape = Mrecord, penwidth = 2];\n");
-    tree_output_dot_aux(t, out);
+    if(t->root != NULL) {
+        tree_output_dot_aux(t->type, t->root, out);
+    }
+    if(t->broot != NULL) {
+        btree_output_dot_aux(t->broot, out);
+    }
     fprintf(out, "}\n");
 }
 /**
- * Free the memory space used by the tree
+ * Free the memory space used by the tree. The nodes and keys all
+ * live in the node pool and key arena, so those are released whole
  * 
  * @param t the tree to free
  *
- * @return t the freed tree
+ * @return NULL as the tree is gone
  */
 tree tree_free(tree t){
-    if(t == NULL){
-        free(t);
-        return t;
-    }
-    if(t->left != NULL)
-        tree_free(t->left);
-    if(t->right != NULL)
-        tree_free(t->right);
-    free(t->key);
+    eytz_free(t);
+    arena_free(t->nodes);
+    arena_free(t->keys);
+    if(t->image_mapped)
+        unmap_stream(t->image, t->image_size);
+    else
+        free(t->image);
     free(t);
-    return t;
+    return NULL;
+}
+
+/* a node tree_save has reached but not yet numbered, and where its
+   position goes once it has one: into link, or if link is NULL into
+   the left of the entry below it on the stack, which is its parent.
+   The position of its left child is kept in left until then */
+struct save_visit {
+    node n;
+    int32_t left;
+    int32_t *link;
+};
+
+/**
+ * push a node and the chain of left children below it for tree_save,
+ * which numbers them in order as they come off the stack
+ *
+ * @param stack the stack, may be moved when it grows
+ * @param size the number of nodes on the stack
+ * @param cap the number of nodes the stack has room for
+ * @param n the node, or NULL to push nothing
+ * @param link where the position of n goes
+ */
+static void save_push(struct save_visit **stack, int *size, int *cap,
+                      node n, int32_t *link){
+    for(; n != NULL; n = n->left, link = NULL){
+        if(*size == *cap){
+            *cap = (*cap == 0) ? 64 : 2 * *cap;
+            *stack = erealloc(*stack, *cap * sizeof (*stack)[0]);
+        }
+        (*stack)[*size].n = n;
+        (*stack)[*size].left = -1;
+        (*stack)[(*size)++].link = link;
+    }
+}
+
+/**
+ * number the keys of a BTREE node and those below it in order for
+ * btree_save, linking each to its children and the next key of its
+ * node as tree_load expects
+ *
+ * @param n the node
+ * @param saved the keys as they will be saved
+ * @param keys set to the keys in order
+ * @param next the position the next key in order goes at
+ *
+ * @return the position of the node's first key
+ */
+static int btree_save_node(bnode n, struct image_key *saved, char **keys,
+                           int *next){
+    int child = -1;
+    int first = *next;
+    int i, at = -1;
+    for(i = 0; i <= n->count; i++){
+        if(!n->leaf){
+            child = btree_save_node(n->child[i], saved, keys, next);
+            if(i == 0)
+                first = *next;
+        }
+        if(i == n->count)
+            break;
+        if(at >= 0)
+            saved[at].right = *next;
+        at = (*next)++;
+        keys[at] = n->key[i];
+        saved[at].frequency = n->frequency[i];
+        saved[at].left = child;
+        saved[at].colour = 0;
+    }
+    saved[at].right = child;
+    saved[at].colour = 1;
+    return first;
+}
+
+/**
+ * save a BTREE for tree_save, its keys in order linked into nodes of
+ * the shape it has, so that a loaded BTREE searches them where they
+ * are and is built again just as it was if it has to be
+ *
+ * @param t the tree to save
+ * @param head the header of the image, filled in but for the root
+ * and the size of the text
+ * @param out the stream to save to
+ *
+ * @return 1 if the tree was saved, 0 if it could not be
+ */
+static int btree_save(tree t, struct image_header *head, FILE *out){
+    struct image_key *saved = emalloc((t->num_keys + 1) * sizeof saved[0]);
+    char **keys = emalloc((t->num_keys + 1) * sizeof keys[0]);
+    uint64_t text = 0;
+    int i, next = 0;
+    head->root = -1;
+    if(t->broot != NULL && t->broot->count > 0)
+        head->root = btree_save_node(t->broot, saved, keys, &next);
+    for(i = 0; i < t->num_keys; i++){
+        saved[i].key = (uint32_t) text;
+        text += strlen(keys[i]) + 1;
+    }
+    head->keys_size = (uint32_t) text;
+    if(text <= UINT32_MAX){
+        fwrite(head, sizeof *head, 1, out);
+        fwrite(saved, sizeof saved[0], t->num_keys, out);
+        for(i = 0; i < t->num_keys; i++)
+            fwrite(keys[i], 1, strlen(keys[i]) + 1, out);
+    }
+    free(saved);
+    free(keys);
+    return text <= UINT32_MAX && fflush(out) == 0 && !ferror(out);
+}
+
+/**
+ * save the tree to a stream as an image tree_load can use without
+ * inserting any keys: a header, the nodes in key order with the keys
+ * as offsets into their text and the children as positions, then the
+ * text. The image is only meant to be loaded on the same kind of
+ * machine it was saved on.
+ *
+ * @param t the tree to save
+ * @param out the stream to save to, opened for binary writing
+ *
+ * @return 1 if the tree was saved, 0 if it could not be
+ */
+int tree_save(tree t, FILE *out){
+    struct image_header head;
+    struct image_key *saved;
+    struct save_visit *stack = NULL;
+    struct save_visit v;
+    node *order;
+    int size = 0;
+    int cap = 0;
+    uint64_t text = 0;
+    int i;
+
+    memset(&head, 0, sizeof head);
+    memcpy(head.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+    head.byte_order = IMAGE_ORDER;
+    head.type = t->type;
+    head.num_keys = t->num_keys;
+    head.num_words = t->num_words;
+    if(t->frozen != NULL){
+        /* still as it was loaded, so save the image again */
+        head.root = t->frozen_root;
+        head.keys_size = t->image_size - sizeof head
+            - t->num_keys * sizeof t->frozen[0];
+        fwrite(&head, sizeof head, 1, out);
+        fwrite(t->frozen, sizeof t->frozen[0], t->num_keys, out);
+        fwrite(t->frozen + t->num_keys, 1, head.keys_size, out);
+        return fflush(out) == 0 && !ferror(out);
+    }
+
+    if(t->type == BTREE)
+        return btree_save(t, &head, out);
+
+    saved = emalloc((t->num_keys + 1) * sizeof saved[0]);
+    order = emalloc((t->num_keys + 1) * sizeof order[0]);
+    /* number the nodes in order, each linked to its children once
+       they have their numbers too */
+    head.root = -1;
+    save_push(&stack, &size, &cap, t->root, &head.root);
+    for(i = 0; size > 0; i++){
+        v = stack[--size];
+        order[i] = v.n;
+        saved[i].key = (uint32_t) text;
+        saved[i].frequency = v.n->frequency;
+        saved[i].left = v.left;
+        saved[i].right = -1;
+        saved[i].colour = (RED == v.n->colour);
+        text += strlen(node_key(v.n)) + 1;
+        if(v.link != NULL)
+            *v.link = i;
+        else
+            stack[size - 1].left = i;
+        save_push(&stack, &size, &cap, v.n->right, &saved[i].right);
+    }
+    free(stack);
+    head.keys_size = (uint32_t) text;
+    if(text <= UINT32_MAX){
+        fwrite(&head, sizeof head, 1, out);
+        fwrite(saved, sizeof saved[0], t->num_keys, out);
+        for(i = 0; i < t->num_keys; i++)
+            fwrite(node_key(order[i]), 1, strlen(node_key(order[i])) + 1,
+                   out);
+    }
+    free(order);
+    free(saved);
+    return text <= UINT32_MAX && fflush(out) == 0 && !ferror(out);
+}
+
+/**
+ * check that the saved keys of a BTREE link up into nodes tree_thaw
+ * can build: every key in a node of at most BTREE_MAX keys, each of
+ * which has a child before and after it or none do, and every leaf
+ * as deep as every other. The keys must already be known to have
+ * one parent each.
+ *
+ * @param k the saved keys
+ * @param n the number of keys
+ * @param root the first key of the root
+ *
+ * @return 1 if they can be built into a BTREE, 0 if not
+ */
+static int btree_image_check(const struct image_key *k, int32_t n,
+                             int32_t root){
+    int32_t *stack = emalloc((n + 1) * sizeof stack[0]);
+    int *depth = emalloc((n + 1) * sizeof depth[0]);
+    int32_t i, seen = 0;
+    int size = 0, count, leaf, d, leaf_depth = -1;
+    int result = 1;
+    if(n > 0){
+        stack[size] = root;
+        depth[size++] = 0;
+    }
+    while(size > 0 && result){
+        i = stack[--size];
+        d = depth[size];
+        leaf = (k[i].left < 0);
+        if(leaf && leaf_depth < 0)
+            leaf_depth = d;
+        if(leaf != (d == leaf_depth))
+            result = 0;
+        for(count = 1; result; count++){
+            if(count > BTREE_MAX || (k[i].left < 0) != leaf
+               || (!k[i].colour && k[i].right < 0)){
+                result = 0;
+                break;
+            }
+            if(!leaf){
+                stack[size] = k[i].left;
+                depth[size++] = d + 1;
+            }
+            seen++;
+            if(k[i].colour)
+                break;
+            i = k[i].right;
+        }
+        if(result && (k[i].right < 0) != leaf)
+            result = 0;
+        else if(result && !leaf){
+            stack[size] = k[i].right;
+            depth[size++] = d + 1;
+        }
+    }
+    free(stack);
+    free(depth);
+    return result && seen == n;
+}
+
+/**
+ * check that some memory holds a whole tree image saved on this kind
+ * of machine, with every key inside it
+ *
+ * @param image the image
+ * @param size the size of the image
+ * @param head set to the header of the image
+ *
+ * @return 1 if the image can be used, 0 if not
+ */
+static int image_check(const char *image, size_t size,
+                       struct image_header *head){
+    const struct image_key *k;
+    char *parented;
+    int32_t i, n;
+    int result = 1;
+    if(size < sizeof *head)
+        return 0;
+    memcpy(head, image, sizeof *head);
+    if(memcmp(head->magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC) != 0
+       || head->byte_order != IMAGE_ORDER || head->type > BTREE
+       || head->num_keys > INT32_MAX / sizeof *k
+       || (size - sizeof *head) / sizeof *k < head->num_keys
+       || size - sizeof *head - head->num_keys * sizeof *k
+          != head->keys_size
+       || (head->keys_size > 0 && image[size - 1] != '\0'))
+        return 0;
+    n = head->num_keys;
+    if(head->root < -1 || head->root >= n || (n > 0) != (head->root >= 0))
+        return 0;
+    /* every child must be on the correct side of its parent and have
+       no other parent, so walking down from the root always ends */
+    k = (const struct image_key *) (image + sizeof *head);
+    parented = emalloc(n + 1);
+    memset(parented, 0, n + 1);
+    if(n > 0)
+        parented[head->root] = 1;
+    for(i = 0; i < n && result; i++){
+        if(k[i].key >= head->keys_size
+           || k[i].left < -1 || k[i].left >= i
+           || k[i].right >= n || (k[i].right >= 0 && k[i].right <= i)
+           || (k[i].left >= 0 && parented[k[i].left]++)
+           || (k[i].right >= 0 && parented[k[i].right]++))
+            result = 0;
+    }
+    free(parented);
+    if(result && head->type == BTREE)
+        result = btree_image_check(k, n, head->root);
+    return result;
+}
+
+/**
+ * load a tree saved by tree_save. The image is mapped into memory when
+ * the stream is a file, and the tree binary searches its sorted keys
+ * where they are, so loading takes no allocation for each key. The
+ * tree is only turned back into nodes if it is changed or walked in
+ * any way but in order.
+ *
+ * @param in the stream to load from, opened for binary reading
+ *
+ * @return the loaded tree, or NULL if the stream does not hold a tree
+ * image saved on this kind of machine
+ */
+tree tree_load(FILE *in){
+    struct image_header head;
+    size_t size;
+    char *image = map_stream(in, &size);
+    int mapped = (image != NULL);
+    tree result;
+
+    if(!mapped)
+        image = read_stream(in, &size);
+    if(!image_check(image, size, &head)){
+        if(mapped)
+            unmap_stream(image, size);
+        else
+            free(image);
+        return NULL;
+    }
+    result = tree_new((tree_t) head.type);
+    result->num_keys = head.num_keys;
+    result->num_words = head.num_words;
+    result->frozen = (struct image_key *) (image + sizeof head);
+    result->frozen_root = head.root;
+    result->image = image;
+    result->image_size = size;
+    result->image_mapped = mapped;
+    return result;
 }
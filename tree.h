@@ -11,8 +11,8 @@
 #ifndef TREE_H_
 #define TREE_H_
 
-typedef struct tree_node *tree;
-typedef enum tree_e {BST, RBT} tree_t;
+typedef struct treerec *tree;
+typedef enum tree_e {BST, RBT, BTREE} tree_t;
 
 extern void blackener(tree t);
 extern tree tree_free(tree t);
@@ -21,7 +21,13 @@ extern void tree_preorder(tree r, void f(char *str, int f));
 extern tree tree_insert(tree t, char *str);
 extern tree tree_new(tree_t tree_type);
 extern int tree_search(tree t, char *str);
+extern void tree_search_batch(tree t, char **words, int n, int *results);
+extern int tree_freeze(tree t);
 extern int tree_depth(tree t);
+extern int tree_num_keys(tree t);
 extern void tree_output_dot(tree t, FILE *out);
+extern void tree_merge(tree dst, tree src);
+extern int tree_save(tree t, FILE *out);
+extern tree tree_load(FILE *in);
 
 #endif
@@ -0,0 +1,200 @@
+/********************************************************\
+ * wordbench-main --benchmark for the word tokenizers.  *
+ *                                                      *
+ * Authors:    James Douglas, Paul Souter,              *
+ *             Ryan Swanepoel                           *
+ *                                                      *
+ * Purpose:    to time getword against the scalar and   *
+ *             vector word reader kernels on the same   *
+ *             text and check they find the same words. *
+ *                                                      *
+ * Usage:                                               *
+ *      ./wordbench [OPTION]... <STDIN>                 *
+\********************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "mylib.h"
+
+#define DEFAULT_ROUNDS 5
+
+/* what one tokenizer found in the text */
+struct tally {
+    long words;
+    unsigned long sum;/*a hash of every word in order, or their lengths*/
+};
+
+/**
+ * Adds a word to a tally, so that the same words in the same order
+ * always give the same sum.
+ *
+ * @param t the tally.
+ * @param word the word.
+ */
+static void tally_word(struct tally *t, const char *word){
+    unsigned long sum = t->sum;
+    while(*word != '\0'){
+        sum = (sum ^ (unsigned char) *word++) * 16777619ul;
+    }
+    t->sum = (sum ^ ' ') * 16777619ul;
+    t->words++;
+}
+
+/**
+ * Tokenizes a copy of the text once, with getword through a memory
+ * stream or with a word reader. Hashing every word costs more than
+ * finding it, so timed rounds only add up the word lengths.
+ *
+ * @param text the text.
+ * @param copy somewhere to copy the text to, as large as the text.
+ * @param size the length of the text.
+ * @param kernel 0 for getword, 1 for the scalar kernel, 2 for the
+ * default kernel.
+ * @param t the tally to fill in.
+ * @param check whether to hash the words rather than add up their
+ * lengths.
+ *
+ * @return the seconds spent tokenizing.
+ */
+static double tokenize(const char *text, char *copy, size_t size,
+                       int kernel, struct tally *t, int check){
+    char buf[256];
+    char *word;
+    int len;
+    FILE *stream;
+    wordreader r;
+    double start;
+
+    memcpy(copy, text, size);
+    t->words = 0;
+    t->sum = 2166136261ul;
+    if(kernel == 0){
+        stream = fmemopen(copy, size, "r");
+        if(stream == NULL){
+            perror("fmemopen");
+            exit(EXIT_FAILURE);
+        }
+        start = wall_time();
+        while((len = getword(buf, sizeof buf, stream)) != EOF){
+            if(check){
+                tally_word(t, buf);
+            }else{
+                t->sum += len;
+                t->words++;
+            }
+        }
+        start = wall_time() - start;
+        fclose(stream);
+        return start;
+    }
+    r = wordreader_mem(copy, size);
+    if(kernel == 1){
+        wordreader_scalar(r);
+    }
+    start = wall_time();
+    while((len = wordreader_next(r, &word)) != EOF){
+        if(check){
+            tally_word(t, word);
+        }else{
+            t->sum += len;
+            t->words++;
+        }
+    }
+    start = wall_time() - start;
+    wordreader_close(r);
+    return start;
+}
+
+/**
+ * Prints the help message for the program.
+ */
+static void print_help(void){
+    fprintf(stderr, "Usage: ./wordbench [OPTION]... <STDIN>\n\n");
+    fprintf(stderr, "Tokenize the text read from stdin with getword and");
+    fprintf(stderr, " with each word reader kernel,\nthen print the best");
+    fprintf(stderr, " throughput of each on one core.\n\n");
+    fprintf(stderr, " -r ROUNDS\tTime each tokenizer ROUNDS times");
+    fprintf(stderr, " (default %d)\n", DEFAULT_ROUNDS);
+    fprintf(stderr, " -h\t\tPrint this message\n\n");
+}
+
+/**
+ * Main method. Reads all of stdin, checks each tokenizer finds the
+ * same words as getword, then times it, keeping the best of several
+ * rounds.
+ *
+ * @param argc the number of arguments.
+ * @param argv the arguments.
+ *
+ * @return EXIT_SUCCESS if every tokenizer found the same words.
+ */
+int main(int argc, char **argv){
+    const char *optstring = "r:h";
+    const char *names[3];
+    struct tally tallies[3], timed;
+    int rounds = DEFAULT_ROUNDS;
+    int kernel, i, status = EXIT_SUCCESS;
+    double best, secs;
+    size_t size;
+    char *text, *copy;
+    char option;
+
+    while((option = getopt(argc, argv, optstring)) != EOF){
+        switch(option){
+            case 'r':
+                rounds = atoi(optarg);
+                if(rounds < 1){
+                    rounds = 1;
+                }
+                break;
+            case 'h':
+            default:
+                print_help();
+                return EXIT_SUCCESS;
+        }
+    }
+
+    text = read_stream(stdin, &size);
+    if(size == 0){
+        fprintf(stderr, "wordbench: no text to tokenize\n");
+        free(text);
+        return EXIT_FAILURE;
+    }
+    copy = emalloc(size);
+    names[0] = "getword";
+    names[1] = "scalar";
+    names[2] = wordreader_kernel();
+
+    fprintf(stderr, "%-10s%12s%12s%12s\n", "tokenizer", "words",
+            "seconds", "GB/s");
+    for(kernel = 0; kernel < 3; kernel++){
+        if(kernel == 2 && strcmp(names[2], "scalar") == 0){
+            break;
+        }
+        tokenize(text, copy, size, kernel, &tallies[kernel], 1);
+        best = 0.0;
+        for(i = 0; i < rounds; i++){
+            secs = tokenize(text, copy, size, kernel, &timed, 0);
+            if(i == 0 || secs < best){
+                best = secs;
+            }
+        }
+        fprintf(stderr, "%-10s%12ld%12.6f%12.3f\n", names[kernel],
+                tallies[kernel].words, best,
+                best > 0.0 ? size / best / 1e9 : 0.0);
+        if(tallies[kernel].words != tallies[0].words
+           || tallies[kernel].sum != tallies[0].sum){
+            fprintf(stderr, "wordbench: %s found different words to"
+                    " getword\n", names[kernel]);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    free(copy);
+    free(text);
+    return status;
+}